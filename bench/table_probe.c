@@ -0,0 +1,94 @@
+//
+// Created by Fabian Simon on 17.10.26.
+//
+
+// Probe cost of the intern table: copy_string() of names that are already
+// interned (hits) and table_find_string() of names that aren't (misses).
+// The names are rooted as globals so no collection drops them mid-run.
+// Build the same file against an older tree to compare before/after.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define NAMES 200000
+#define PASSES 20
+#define RUNS 5
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+typedef struct {
+    char chars[16];
+    int length;
+    uint32_t hash;
+} Name;
+
+// Formatted and hashed up front so the timed loops only probe.
+static Name* make_names(const char* prefix) {
+    Name* names = malloc(sizeof(Name) * NAMES);
+    if (names == NULL) exit(1);
+
+    for (int i = 0; i < NAMES; i++) {
+        Name* name = &names[i];
+        name->length = snprintf(name->chars, sizeof(name->chars), "%s%d", prefix, i);
+        name->hash = 2166136261u;
+        for (int c = 0; c < name->length; c++) {
+            name->hash ^= (uint8_t) name->chars[c];
+            name->hash *= 16777619;
+        }
+    }
+    return names;
+}
+
+int main() {
+    init_VM();
+
+    Name* hits = make_names("name");
+    Name* misses = make_names("miss");
+    for (int i = 0; i < NAMES; i++) {
+        define_global_slot(copy_string(hits[i].chars, hits[i].length));
+    }
+
+    double best_hit = 0, best_miss = 0;
+    size_t found = 0;
+    for (int run = 0; run < RUNS; run++) {
+        double start = now();
+        for (int pass = 0; pass < PASSES; pass++) {
+            for (int i = 0; i < NAMES; i++) {
+                found += copy_string(hits[i].chars, hits[i].length) != NULL;
+            }
+        }
+        double hit = (now() - start) / ((double) NAMES * PASSES);
+
+        start = now();
+        for (int pass = 0; pass < PASSES; pass++) {
+            for (int i = 0; i < NAMES; i++) {
+                Name* name = &misses[i];
+                found += table_find_string(&vm.strings, name->chars, name->length, name->hash) != NULL;
+            }
+        }
+        double miss = (now() - start) / ((double) NAMES * PASSES);
+
+        if (run == 0 || hit < best_hit) best_hit = hit;
+        if (run == 0 || miss < best_miss) best_miss = miss;
+    }
+
+    // Hits go through copy_string(), so they include hashing the name.
+    printf("hit  %.1f ns/op\n", best_hit);
+    printf("miss %.1f ns/op\n", best_miss);
+    printf("(%zu found)\n", found);
+
+    free(hits);
+    free(misses);
+    free_VM();
+    return 0;
+}
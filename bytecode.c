@@ -0,0 +1,518 @@
+//
+// Created by Fabian Simon on 17.10.26.
+//
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "vm.h"
+
+// Files are only ever read back by the build that wrote them, so everything
+// is stored in native byte order. Code and lines are aligned so a loaded
+// chunk can point straight into the mapped file. Bump the version whenever
+// the instruction set or this layout changes.
+#define BYTECODE_MAGIC "FAVEC"
+#define BYTECODE_VERSION 3
+
+typedef enum {
+    TAG_NIL_CONSTANT,
+    TAG_TRUE_CONSTANT,
+    TAG_FALSE_CONSTANT,
+    TAG_NUMBER_CONSTANT,
+    TAG_STRING_CONSTANT,
+    TAG_FUNCTION_CONSTANT
+} ConstantTag;
+
+uint64_t hash_source(const char* src) {
+    uint64_t hash = 14695981039346656037u;
+    for (const char* c = src; *c != '\0'; c++) {
+        hash ^= (uint8_t) *c;
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+static bool write_bytes(FILE* file, const void* bytes, size_t size) {
+    return fwrite(bytes, 1, size, file) == size;
+}
+
+static bool write_padding(FILE* file, size_t alignment) {
+    long position = ftell(file);
+    if (position < 0) return false;
+
+    static const uint8_t zeroes[sizeof(int)] = {0};
+    return write_bytes(file, zeroes, (alignment - (size_t) position % alignment) % alignment);
+}
+
+static bool write_u32(FILE* file, uint32_t value) {
+    return write_bytes(file, &value, sizeof(value));
+}
+
+static bool write_string(FILE* file, ObjString* string) {
+    return write_u32(file, (uint32_t) string->length) &&
+           write_bytes(file, string->chars, string->length);
+}
+
+static bool write_function(FILE* file, ObjFunction* function);
+
+static bool write_constant(FILE* file, Value val) {
+    uint8_t tag;
+    if (IS_NIL(val)) tag = TAG_NIL_CONSTANT;
+    else if (IS_BOOL(val)) tag = AS_BOOL(val) ? TAG_TRUE_CONSTANT : TAG_FALSE_CONSTANT;
+    else if (IS_NUMBER(val)) tag = TAG_NUMBER_CONSTANT;
+    else if (IS_STRING(val)) tag = TAG_STRING_CONSTANT;
+    else if (IS_FUNCTION(val)) tag = TAG_FUNCTION_CONSTANT;
+    else return false; // Ropes are never constants.
+
+    if (!write_bytes(file, &tag, 1)) return false;
+
+    switch (tag) {
+        case TAG_NUMBER_CONSTANT: {
+            double number = AS_NUMBER(val);
+            return write_bytes(file, &number, sizeof(number));
+        }
+        case TAG_STRING_CONSTANT:   return write_string(file, AS_STRING(val));
+        case TAG_FUNCTION_CONSTANT: return write_function(file, AS_FUNCTION(val));
+        default:                    return true;
+    }
+}
+
+static bool write_function(FILE* file, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    uint8_t has_name = function->name != NULL;
+
+    if (!write_u32(file, (uint32_t) function->arity)) return false;
+    if (!write_bytes(file, &has_name, 1)) return false;
+    if (has_name && !write_string(file, function->name)) return false;
+
+    if (!write_u32(file, (uint32_t) chunk->count)) return false;
+    if (!write_bytes(file, chunk->code, chunk->count)) return false;
+    if (!write_padding(file, sizeof(int))) return false;
+    if (!write_bytes(file, chunk->lines, sizeof(int) * chunk->count)) return false;
+
+    if (!write_u32(file, (uint32_t) chunk->constants.count)) return false;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (!write_constant(file, chunk->constants.values[i])) return false;
+    }
+    return true;
+}
+
+// Global slots are baked into the code, so the names are stored in slot
+// order and re-registered in that order on load.
+static bool write_globals(FILE* file) {
+    if (!write_u32(file, (uint32_t) vm.global_values.count)) return false;
+    for (int slot = 0; slot < vm.global_values.count; slot++) {
+        if (!write_string(file, global_slot_name(slot))) return false;
+    }
+    return true;
+}
+
+bool write_bytecode(const char* path, ObjFunction* function, uint64_t source_hash) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) return false;
+
+    uint8_t version = BYTECODE_VERSION;
+    bool written = write_bytes(file, BYTECODE_MAGIC, strlen(BYTECODE_MAGIC)) &&
+                   write_bytes(file, &version, 1) &&
+                   write_bytes(file, &source_hash, sizeof(source_hash)) &&
+                   write_globals(file) &&
+                   write_function(file, function);
+
+    if (fclose(file) != 0) written = false;
+    if (!written) remove(path);
+    return written;
+}
+
+typedef struct {
+    const uint8_t* start;
+    const uint8_t* current;
+    const uint8_t* end;
+    int global_count; // Slots the image's code may use, from its globals section.
+} Reader;
+
+// Returns the next size bytes of the image, aligned relative to its start,
+// or NULL if the image is too short.
+static const uint8_t* borrow_bytes(Reader* reader, size_t size, size_t alignment) {
+    size_t position = (size_t) (reader->current - reader->start);
+    const uint8_t* bytes = reader->current + (alignment - position % alignment) % alignment;
+    if (bytes > reader->end || (size_t) (reader->end - bytes) < size) return NULL;
+
+    reader->current = bytes + size;
+    return bytes;
+}
+
+static bool read_bytes(Reader* reader, void* dest, size_t size) {
+    const uint8_t* bytes = borrow_bytes(reader, size, 1);
+    if (bytes == NULL) return false;
+    memcpy(dest, bytes, size);
+    return true;
+}
+
+static bool read_u32(Reader* reader, uint32_t* value) {
+    return read_bytes(reader, value, sizeof(*value));
+}
+
+// Strings can't be borrowed: their characters live inline in the object,
+// and they have to be interned anyway.
+static ObjString* read_string(Reader* reader) {
+    uint32_t length;
+    if (!read_u32(reader, &length) || length > INT32_MAX) return NULL;
+
+    const uint8_t* chars = borrow_bytes(reader, length, 1);
+    return chars == NULL ? NULL : copy_string((const char*) chars, (int) length);
+}
+
+static ObjFunction* read_function(Reader* reader);
+
+static bool read_constant(Reader* reader, Value* val) {
+    uint8_t tag;
+    if (!read_bytes(reader, &tag, 1)) return false;
+
+    switch (tag) {
+        case TAG_NIL_CONSTANT:      *val = NIL_VAL; return true;
+        case TAG_TRUE_CONSTANT:     *val = BOOL_VAL(true); return true;
+        case TAG_FALSE_CONSTANT:    *val = BOOL_VAL(false); return true;
+        case TAG_NUMBER_CONSTANT: {
+            double number;
+            if (!read_bytes(reader, &number, sizeof(number))) return false;
+            *val = NUMBER_VAL(number);
+            return true;
+        }
+        case TAG_STRING_CONSTANT: {
+            ObjString* string = read_string(reader);
+            if (string == NULL) return false;
+            *val = OBJ_VAL(string);
+            return true;
+        }
+        case TAG_FUNCTION_CONSTANT: {
+            ObjFunction* function = read_function(reader);
+            if (function == NULL) return false;
+            *val = OBJ_VAL(function);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// Checks that one instruction only refers to constants and global slots that
+// exist, and that it was written generic: a read-only chunk can't be dequickened. Locals need no check: a frame's 256 slots always fit on the stack.
+static bool verify_operands(Chunk* chunk, int offset, int global_count) {
+    uint8_t* code = chunk->code + offset;
+    int constant;
+
+    switch (code[0]) {
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_EQUAL_NUM:
+        case OP_NOT_EQUAL_NUM:
+            return false; // Only the VM quickens, and never in a borrowed chunk.
+        case OP_CONSTANT:
+            constant = code[1];
+            break;
+        case OP_INCREMENT_LOCAL:
+        case OP_INCREMENT_LOCAL_POP:
+        case OP_DECREMENT_LOCAL:
+        case OP_DECREMENT_LOCAL_POP:
+        case OP_JUMP_UNLESS_LESS_LOCAL:
+        case OP_JUMP_UNLESS_GREATER_LOCAL:
+        case OP_JUMP_IF_LESS_LOCAL:
+        case OP_JUMP_IF_GREATER_LOCAL:
+            constant = code[2];
+            break;
+        case OP_ADD_REG_CONST:
+        case OP_SUBTRACT_REG_CONST:
+        case OP_MULTIPLY_REG_CONST:
+        case OP_DIVIDE_REG_CONST:
+            constant = code[3];
+            break;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+            return ((code[1] << 8) | code[2]) < global_count;
+        default:
+            return true;
+    }
+    return constant < chunk->constants.count;
+}
+
+// Returns the stack depth after the instruction at offset, given the depth
+// before it, or -1 if it would pop the function's own slot 0 or use a local
+// slot at or above the stack top. Depths count slot 0.
+static int stack_effect(Chunk* chunk, int offset, int depth) {
+    uint8_t* code = chunk->code + offset;
+
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+            return depth+1;
+        case OP_POP:
+        case OP_PRINT:
+        case OP_DEFINE_GLOBAL:
+            return depth > 1 ? depth-1 : -1;
+        case OP_SET_GLOBAL:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_JUMP_IF_FALSE:
+            return depth > 1 ? depth : -1;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            return depth > 2 ? depth-1 : -1;
+        case OP_GET_LOCAL:
+            return code[1] < depth ? depth+1 : -1;
+        case OP_SET_LOCAL:
+            return depth > 1 && code[1] < depth ? depth : -1;
+        case OP_SET_LOCAL_POP:
+            return depth > 1 && code[1] < depth-1 ? depth-1 : -1;
+        case OP_ADD_LOCAL_LOCAL:
+            return code[1] < depth && code[2] < depth ? depth+1 : -1;
+        case OP_INCREMENT_LOCAL:
+        case OP_DECREMENT_LOCAL:
+            return code[1] < depth ? depth+1 : -1;
+        case OP_INCREMENT_LOCAL_POP:
+        case OP_DECREMENT_LOCAL_POP:
+        case OP_JUMP_UNLESS_LESS_LOCAL:
+        case OP_JUMP_UNLESS_GREATER_LOCAL:
+        case OP_JUMP_IF_LESS_LOCAL:
+        case OP_JUMP_IF_GREATER_LOCAL:
+            return code[1] < depth ? depth : -1;
+        case OP_ADD_REG_REG:
+        case OP_SUBTRACT_REG_REG:
+        case OP_MULTIPLY_REG_REG:
+        case OP_DIVIDE_REG_REG:
+            return code[1] < depth && code[2] < depth && code[3] < depth ? depth : -1;
+        case OP_ADD_REG_CONST:
+        case OP_SUBTRACT_REG_CONST:
+        case OP_MULTIPLY_REG_CONST:
+        case OP_DIVIDE_REG_CONST:
+            return code[1] < depth && code[2] < depth ? depth : -1;
+        default: // OP_JUMP, OP_LOOP and OP_RETURN.
+            return depth;
+    }
+}
+
+typedef struct {
+    bool* starts;
+    int* depths; // Stack depth on entry to each instruction, -1 until it is reached.
+    int* pending;
+    int pending_count;
+} FlowState;
+
+// Records that control reaches target with the given stack depth. Every path
+// into an instruction has to agree on the depth.
+static bool reach(FlowState* flow, int count, int target, int depth) {
+    if (target < 0 || target >= count || !flow->starts[target]) return false;
+    if (flow->depths[target] >= 0) return flow->depths[target] == depth;
+
+    flow->depths[target] = depth;
+    flow->pending[flow->pending_count++] = target;
+    return true;
+}
+
+// The source hash only says which program an image belongs to, not that the
+// file is intact, so its code is checked before the VM runs it. Every
+// instruction has to be known and complete, and every jump has to land on an
+// instruction. Then every path from the entry, which starts with depth values
+// on the stack, has to keep the stack in bounds and end in a return rather
+// than run off the end. Room is left for the two values the slow paths of the
+// fused local ops push.
+static bool verify_chunk(Chunk* chunk, int depth, int global_count) {
+    int count = chunk->count;
+    if (count == 0) return false;
+
+    FlowState flow;
+    flow.starts = ALLOCATE(bool, count);
+    flow.depths = ALLOCATE(int, count);
+    flow.pending = ALLOCATE(int, count);
+    flow.pending_count = 0;
+    for (int offset = 0; offset < count; offset++) {
+        flow.starts[offset] = false;
+        flow.depths[offset] = -1;
+    }
+
+    bool valid = true;
+    for (int offset = 0; valid && offset < count; offset += instruction_length(chunk->code[offset])) {
+        flow.starts[offset] = true;
+        valid = chunk->code[offset] <= OP_RETURN &&
+                instruction_length(chunk->code[offset]) <= count - offset &&
+                verify_operands(chunk, offset, global_count);
+    }
+
+    // The JIT maps every jump target, reachable or not.
+    for (int offset = 0; valid && offset < count; offset += instruction_length(chunk->code[offset])) {
+        if (!is_jump(chunk->code[offset])) continue;
+        int target = jump_target(chunk, offset);
+        valid = target >= 0 && target < count && flow.starts[target];
+    }
+
+    valid = valid && reach(&flow, count, 0, depth);
+    while (valid && flow.pending_count > 0) {
+        int offset = flow.pending[--flow.pending_count];
+        uint8_t instruction = chunk->code[offset];
+        int after = stack_effect(chunk, offset, flow.depths[offset]);
+        if (after < 0 || after + 2 > STACK_MAX) {
+            valid = false;
+        } else if (instruction != OP_RETURN) {
+            if (is_jump(instruction)) valid = reach(&flow, count, jump_target(chunk, offset), after);
+            if (instruction != OP_JUMP && instruction != OP_LOOP) {
+                valid = valid && reach(&flow, count, offset + instruction_length(instruction), after);
+            }
+        }
+    }
+
+    FREE_ARRAY(bool, flow.starts, count);
+    FREE_ARRAY(int, flow.depths, count);
+    FREE_ARRAY(int, flow.pending, count);
+    return valid;
+}
+
+static bool read_function_body(Reader* reader, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    uint32_t arity, code_count, constant_count;
+    uint8_t has_name;
+
+    if (!read_u32(reader, &arity) || arity > UINT8_MAX || !read_bytes(reader, &has_name, 1)) return false;
+    function->arity = (int) arity;
+
+    if (has_name) {
+        function->name = read_string(reader);
+        if (function->name == NULL) return false;
+        write_barrier((Obj*) function, OBJ_VAL(function->name));
+    }
+
+    if (!read_u32(reader, &code_count) || code_count > INT32_MAX) return false;
+    const uint8_t* code = borrow_bytes(reader, code_count, 1);
+    const uint8_t* lines = borrow_bytes(reader, sizeof(int) * code_count, sizeof(int));
+    if (code == NULL || lines == NULL) return false;
+
+    // The mapping is read-only, so every process running this image shares its pages.
+    chunk->code = (uint8_t*) code;
+    chunk->lines = (int*) lines;
+    chunk->count = (int) code_count;
+    chunk->capacity = (int) code_count;
+    chunk->borrowed = true;
+
+    // Constants are decoded up front: strings have to be interned anyway.
+    if (!read_u32(reader, &constant_count) || constant_count > UINT8_COUNT) return false;
+    for (uint32_t i = 0; i < constant_count; i++) {
+        Value val;
+        if (!read_constant(reader, &val)) return false;
+        write_barrier((Obj*) function, val);
+        add_constant(chunk, val);
+    }
+    // A call leaves the function and its arguments in the frame's first slots.
+    return verify_chunk(chunk, 1 + function->arity, reader->global_count);
+}
+
+// The function stays on the VM stack while it is filled in so a collection
+// triggered by any of its allocations can't free it.
+static ObjFunction* read_function(Reader* reader) {
+    ObjFunction* function = new_function();
+    push(OBJ_VAL(function));
+    bool ok = read_function_body(reader, function);
+    pop();
+    return ok ? function : NULL;
+}
+
+// Only checks that the globals section is complete, leaving globals at its
+// start. The names are registered by define_globals() once the code has been
+// verified, so a rejected image leaves none of them behind.
+static bool skip_globals(Reader* reader, Reader* globals) {
+    *globals = *reader;
+
+    uint32_t count;
+    if (!read_u32(reader, &count) || count > UINT16_MAX+1) return false;
+
+    for (uint32_t slot = 0; slot < count; slot++) {
+        uint32_t length;
+        if (!read_u32(reader, &length) || length > INT32_MAX || borrow_bytes(reader, length, 1) == NULL) return false;
+    }
+    reader->global_count = (int) count;
+    return true;
+}
+
+// The code refers to globals by slot, so each name has to get back the slot
+// it was written from. If one doesn't, the names added so far are dropped again.
+static bool define_globals(Reader* globals) {
+    int defined = vm.global_values.count;
+    uint32_t count;
+    read_u32(globals, &count);
+
+    for (uint32_t slot = 0; slot < count; slot++) {
+        ObjString* name = read_string(globals);
+        if (name == NULL || define_global_slot(name) != (int) slot) {
+            truncate_globals(defined);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool read_header(Reader* reader, uint64_t source_hash) {
+    const uint8_t* magic = borrow_bytes(reader, strlen(BYTECODE_MAGIC), 1);
+    uint8_t version;
+    uint64_t hash;
+
+    return magic != NULL && memcmp(magic, BYTECODE_MAGIC, strlen(BYTECODE_MAGIC)) == 0 &&
+           read_bytes(reader, &version, 1) && version == BYTECODE_VERSION &&
+           read_bytes(reader, &hash, sizeof(hash)) && hash == source_hash;
+}
+
+ObjFunction* read_bytecode(const char* path, uint64_t source_hash, BytecodeImage* image) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat info;
+    void* base = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        base = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+
+    Reader reader = {base, base, (const uint8_t*) base + info.st_size, 0};
+    Reader globals;
+    ObjFunction* function = NULL;
+    if (read_header(&reader, source_hash) && skip_globals(&reader, &globals)) function = read_function(&reader);
+
+    if (function != NULL) {
+        push(OBJ_VAL(function)); // Interning the names allocates.
+        if (!define_globals(&globals)) function = NULL;
+        pop();
+    }
+
+    // Functions from a failed load are garbage, and their chunks never free borrowed memory.
+    if (function == NULL) {
+        munmap(base, (size_t) info.st_size);
+        return NULL;
+    }
+
+    image->base = base;
+    image->size = (size_t) info.st_size;
+    return function;
+}
+
+void close_bytecode(BytecodeImage* image) {
+    if (image->base != NULL) munmap(image->base, image->size);
+    image->base = NULL;
+    image->size = 0;
+}
@@ -0,0 +1,22 @@
+//
+// Created by Fabian Simon on 17.10.26.
+//
+
+#ifndef FAVE_CUH_BYTECODE_H
+#define FAVE_CUH_BYTECODE_H
+
+#include "object.h"
+
+// A bytecode file mapped into memory. Loaded chunks borrow their code and
+// lines from it, so it has to outlive every function read from it.
+typedef struct {
+    void* base;
+    size_t size;
+} BytecodeImage;
+
+uint64_t hash_source(const char* src);
+bool write_bytecode(const char* path, ObjFunction* function, uint64_t source_hash);
+ObjFunction* read_bytecode(const char* path, uint64_t source_hash, BytecodeImage* image);
+void close_bytecode(BytecodeImage* image);
+
+#endif //FAVE_CUH_BYTECODE_H
@@ -7,18 +7,22 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "vm.h"
 
 void init_chunk(Chunk* chunk) {
     chunk->count = 0;
     chunk->capacity= 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->borrowed = false;
     init_value_array(&chunk->constants);
 }
 
 void free_chunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    if (!chunk->borrowed) {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    }
     free_value_array(&chunk->constants);
     init_chunk(chunk);
 }
@@ -37,6 +41,15 @@ void write_chunk(Chunk* chunk, uint8_t byte, int line) {
 }
 
 int add_constant(Chunk* chunk, Value val) {
+    // Keep the value reachable if growing the array triggers a collection.
+    // A thread's heap is never collected, and the VM's stack isn't its to use.
+    if (thread_heap != NULL) {
+        write_value_array(&chunk->constants, val);
+        return chunk->constants.count-1;
+    }
+
+    push(val);
     write_value_array(&chunk->constants, val);
+    pop();
     return chunk->constants.count-1;
 }
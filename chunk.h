@@ -18,10 +18,14 @@ typedef enum {
     OP_GET_GLOBAL,
     OP_DEFINE_GLOBAL,
     OP_SET_LOCAL,
+    OP_SET_LOCAL_POP,
     OP_SET_GLOBAL,
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
+    OP_NOT_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
@@ -32,6 +36,27 @@ typedef enum {
     OP_JUMP,
     OP_JUMP_IF_FALSE,
     OP_LOOP,
+    OP_ADD_LOCAL_LOCAL,
+    OP_INCREMENT_LOCAL,
+    OP_INCREMENT_LOCAL_POP,
+    OP_DECREMENT_LOCAL,
+    OP_DECREMENT_LOCAL_POP,
+    OP_JUMP_UNLESS_LESS_LOCAL,
+    OP_JUMP_UNLESS_GREATER_LOCAL,
+    OP_JUMP_IF_LESS_LOCAL,
+    OP_JUMP_IF_GREATER_LOCAL,
+    OP_ADD_REG_REG,
+    OP_ADD_REG_CONST,
+    OP_SUBTRACT_REG_REG,
+    OP_SUBTRACT_REG_CONST,
+    OP_MULTIPLY_REG_REG,
+    OP_MULTIPLY_REG_CONST,
+    OP_DIVIDE_REG_REG,
+    OP_DIVIDE_REG_CONST,
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_EQUAL_NUM,
+    OP_NOT_EQUAL_NUM,
     OP_RETURN
 } OpCode;
 
@@ -40,6 +65,7 @@ typedef struct {
     int capacity;
     uint8_t* code;
     int* lines;
+    bool borrowed; // code and lines point into a mapped bytecode image.
     ValueArray constants;
 } Chunk;
 
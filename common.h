@@ -10,7 +10,19 @@
 #include <stdint.h>
 
 #define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+// #define DEBUG_TRACE_EXECUTION // Needs -DJIT=OFF: jitted loops never pass through the dispatch loop.
+
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
+
+// The JIT emits x86-64 code into mmap'd pages. CMake only asks for it on x86-64 Linux.
+#if defined(JIT) && (!defined(__x86_64__) || !defined(__linux__))
+#undef JIT
+#endif
+
+#if defined(JIT) && defined(DEBUG_TRACE_EXECUTION)
+#error "DEBUG_TRACE_EXECUTION can't see jitted code; configure with -DJIT=OFF to trace"
+#endif
 
 #define UINT8_COUNT (UINT8_MAX+1)
 
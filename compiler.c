@@ -8,6 +8,8 @@
 
 #include "compiler.h"
 #include "common.h"
+#include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -19,6 +21,7 @@ typedef struct {
     Token prev;
     bool had_error;
     bool panic_mode;
+    int operand_start; // Chunk offset where the left operand of the current infix rule begins.
 } Parser;
 
 typedef enum {
@@ -63,9 +66,10 @@ typedef struct Compiler {
     int scope_depth;
 } Compiler;
 
-Parser parser;
-Compiler* current = NULL;
-Chunk* compiling_chunk;
+// Each thread compiles on its own, see Heap.
+_Thread_local Parser parser;
+_Thread_local Compiler* current = NULL;
+_Thread_local Chunk* compiling_chunk;
 
 static Chunk* get_current_chunk() {
     return &current->function->chunk;
@@ -74,6 +78,7 @@ static Chunk* get_current_chunk() {
 static void error_at(Token* token, const char* message) {
     if (parser.panic_mode) return;
     parser.panic_mode = true;
+    flockfile(stderr); // One message at a time when several threads compile.
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
@@ -85,6 +90,7 @@ static void error_at(Token* token, const char* message) {
     }
 
     fprintf(stderr, ": %s\n", message);
+    funlockfile(stderr);
     parser.had_error = true;
 }
 
@@ -156,6 +162,7 @@ static void emit_return() {
 }
 
 static uint8_t make_constant(Value val) {
+    write_barrier((Obj*) current->function, val);
     int constant = add_constant(get_current_chunk(), val);
     if (constant > UINT8_MAX) {
         error("Too many constants in one chunk");
@@ -180,6 +187,207 @@ static void patch_jump(int offset) {
     get_current_chunk()->code[offset+1] = jump & 0xff;
 }
 
+// Reports whether the code in [start, end) is a single instruction that
+// pushes a compile-time constant, and if so which one.
+static bool constant_between(int start, int end, Value* val) {
+    Chunk* chunk = get_current_chunk();
+
+    if (end - start == 2 && chunk->code[start] == OP_CONSTANT) {
+        *val = chunk->constants.values[chunk->code[start+1]];
+        return true;
+    }
+
+    if (end - start != 1) return false;
+    switch (chunk->code[start]) {
+        case OP_NIL:    *val = NIL_VAL; return true;
+        case OP_TRUE:   *val = BOOL_VAL(true); return true;
+        case OP_FALSE:  *val = BOOL_VAL(false); return true;
+        default:        return false;
+    }
+}
+
+static bool constant_since(int start, Value* val) {
+    return constant_between(start, get_current_chunk()->count, val);
+}
+
+// Drops the constant instructions from start onwards, along with any pool
+// entries only they referenced, and emits val in their place.
+static void replace_with_constant(int start, Value val) {
+    Chunk* chunk = get_current_chunk();
+
+    int indices[2];
+    int index_count = 0;
+    for (int offset = start; offset < chunk->count; offset++) {
+        if (chunk->code[offset] == OP_CONSTANT) indices[index_count++] = chunk->code[++offset];
+    }
+
+    for (int i = index_count-1; i >= 0; i--) {
+        if (indices[i] == chunk->constants.count-1) chunk->constants.count--;
+    }
+    chunk->count = start;
+
+    if (IS_NIL(val)) {
+        emit_byte(OP_NIL);
+    } else if (IS_BOOL(val)) {
+        emit_byte(AS_BOOL(val) ? OP_TRUE : OP_FALSE);
+    } else {
+        emit_constant(val);
+    }
+}
+
+static bool is_falsey_constant(Value val) {
+    return IS_NIL(val) || (IS_BOOL(val) && !AS_BOOL(val));
+}
+
+// Evaluates a binary operator on two constants the same way the VM would,
+// refusing anything that would raise a runtime error.
+static bool fold_binary(TokenType operator_type, Value a, Value b, Value* result) {
+    switch (operator_type) {
+        case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(values_equal(a, b)); return true;
+        case TOKEN_BANG_EQUAL:  *result = BOOL_VAL(!values_equal(a, b)); return true;
+        default: break;
+    }
+
+    if (operator_type == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+        int length = left->length + right->length;
+
+        // Plain malloc so no collection runs while the operands are read.
+        char* chars = (char*) malloc(length);
+        if (chars == NULL) exit(1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        *result = OBJ_VAL(copy_string(chars, length));
+        free(chars);
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operator_type) {
+        case TOKEN_PLUS:            *result = NUMBER_VAL(x + y); return true;
+        case TOKEN_MINUS:           *result = NUMBER_VAL(x - y); return true;
+        case TOKEN_STAR:            *result = NUMBER_VAL(x * y); return true;
+        case TOKEN_SLASH:           *result = NUMBER_VAL(x / y); return true;
+        case TOKEN_GREATER:         *result = BOOL_VAL(x > y); return true;
+        case TOKEN_LESS:            *result = BOOL_VAL(x < y); return true;
+        // Compiled as a negated comparison, which differs from >= and <= for NaN.
+        case TOKEN_GREATER_EQUAL:   *result = BOOL_VAL(!(x < y)); return true;
+        case TOKEN_LESS_EQUAL:      *result = BOOL_VAL(!(x > y)); return true;
+        default:                    return false;
+    }
+}
+
+// Fuses `a + b` on two locals into a single instruction.
+static bool emit_add_locals(int left_start, int right_start) {
+    Chunk* chunk = get_current_chunk();
+    if (right_start - left_start != 2 || chunk->count - right_start != 2) return false;
+    if (chunk->code[left_start] != OP_GET_LOCAL || chunk->code[right_start] != OP_GET_LOCAL) return false;
+
+    uint8_t a = chunk->code[left_start+1];
+    uint8_t b = chunk->code[right_start+1];
+    chunk->count = left_start;
+    emit_byte(OP_ADD_LOCAL_LOCAL);
+    emit_bytes(a, b);
+    return true;
+}
+
+// Fuses `slot = slot + k` and `slot = slot - k` for a constant k, compiled
+// from start onwards, into a single instruction.
+static bool emit_increment_local(int start, uint8_t slot) {
+    Chunk* chunk = get_current_chunk();
+    uint8_t* code = &chunk->code[start];
+    if (chunk->count - start != 5) return false;
+    if (code[0] != OP_GET_LOCAL || code[1] != slot || code[2] != OP_CONSTANT) return false;
+
+    uint8_t constant = code[3];
+    uint8_t instruction;
+    switch (code[4]) {
+        case OP_ADD:      instruction = OP_INCREMENT_LOCAL; break;
+        case OP_SUBTRACT: instruction = OP_DECREMENT_LOCAL; break;
+        default:          return false;
+    }
+
+    chunk->count = start;
+    emit_byte(instruction);
+    emit_bytes(slot, constant);
+    return true;
+}
+
+static uint8_t register_opcode(uint8_t instruction, bool constant_operand) {
+    switch (instruction) {
+        case OP_ADD:        return constant_operand ? OP_ADD_REG_CONST : OP_ADD_REG_REG;
+        case OP_SUBTRACT:   return constant_operand ? OP_SUBTRACT_REG_CONST : OP_SUBTRACT_REG_REG;
+        case OP_MULTIPLY:   return constant_operand ? OP_MULTIPLY_REG_CONST : OP_MULTIPLY_REG_REG;
+        case OP_DIVIDE:     return constant_operand ? OP_DIVIDE_REG_CONST : OP_DIVIDE_REG_REG;
+        default:            return 0;
+    }
+}
+
+// Rewrites `dest = a op b`, where a is a local and b a local or a constant,
+// into a three-address instruction that stores straight into dest's slot.
+// The slot is read back afterwards as the assignment's value; the peephole
+// pass drops that read when the value is discarded.
+static bool emit_register_op(int start, uint8_t dest) {
+    Chunk* chunk = get_current_chunk();
+    uint8_t* code = &chunk->code[start];
+    int length = chunk->count - start;
+    uint8_t instruction = 0;
+    uint8_t a, b;
+
+    if (length == 3 && code[0] == OP_ADD_LOCAL_LOCAL) {
+        instruction = OP_ADD_REG_REG;
+        a = code[1];
+        b = code[2];
+    } else if (length == 5 && code[0] == OP_GET_LOCAL &&
+               (code[2] == OP_GET_LOCAL || code[2] == OP_CONSTANT)) {
+        instruction = register_opcode(code[4], code[2] == OP_CONSTANT);
+        a = code[1];
+        b = code[3];
+    }
+    if (instruction == 0) return false;
+
+    chunk->count = start;
+    emit_bytes(instruction, dest);
+    emit_bytes(a, b);
+    emit_bytes(OP_GET_LOCAL, dest);
+    return true;
+}
+
+// Emits the jump taken when the condition compiled from start onwards is
+// false. A local compared against a constant is folded into the jump itself,
+// which leaves no condition on the stack; *fused tells the caller to skip
+// the pops it would otherwise emit.
+static int emit_condition_jump(int start, bool* fused) {
+    Chunk* chunk = get_current_chunk();
+    uint8_t* code = &chunk->code[start];
+    int length = chunk->count - start;
+    *fused = false;
+
+    if ((length == 5 || length == 6) && code[0] == OP_GET_LOCAL && code[2] == OP_CONSTANT) {
+        bool negated = length == 6 && code[5] == OP_NOT;
+        uint8_t jump = 0;
+        if (code[4] == OP_LESS) jump = negated ? OP_JUMP_IF_LESS_LOCAL : OP_JUMP_UNLESS_LESS_LOCAL;
+        if (code[4] == OP_GREATER) jump = negated ? OP_JUMP_IF_GREATER_LOCAL : OP_JUMP_UNLESS_GREATER_LOCAL;
+
+        if (jump != 0 && (length == 5 || negated)) {
+            uint8_t slot = code[1];
+            uint8_t constant = code[3];
+            chunk->count = start;
+            emit_bytes(jump, slot);
+            emit_byte(constant);
+            emit_bytes(0xff, 0xff);
+            *fused = true;
+            return chunk->count-2;
+        }
+    }
+
+    return emit_jump(OP_JUMP_IF_FALSE);
+}
+
 static void init_compiler(Compiler* compiler, FunctionType type) {
     compiler->enclosing = current;
     compiler->function = NULL;
@@ -190,23 +398,29 @@ static void init_compiler(Compiler* compiler, FunctionType type) {
     current = compiler;
 
     if (type != TYPE_SCRIPT) {
-        current->function->name = copy_string(parser.prev.start, parser.prev.length);
+        current->function->name = copy_string_with_hash(parser.prev.start, parser.prev.length, parser.prev.hash);
+        write_barrier((Obj*) current->function, OBJ_VAL(current->function->name));
     }
 
     Local* local = &current->locals[current->local_count++];
     local->depth = 0;
     local->name.start = "";
     local->name.length = 0;
+    local->name.hash = 0;
 }
 
 static ObjFunction* end_compiler() {
     emit_return();
     ObjFunction* function = current->function;
+    if (!parser.had_error) optimize_chunk(get_current_chunk());
 
     #ifdef DEBUG_PRINT_CODE
-    if (!parser.had_error)
+    if (!parser.had_error) {
+        flockfile(stdout);
         disassemble_chunk(get_current_chunk(),
                           function->name != NULL ? function->name->chars : "<script>");
+        funlockfile(stdout);
+    }
     #endif
 
     current = current->enclosing;
@@ -233,12 +447,24 @@ static void declaration();
 static ParseRule* get_rule(TokenType type);
 static void parse_precedence(Precedence precedence);
 
-static uint8_t identifier_constant(Token* name) {
-    return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
+static uint16_t global_slot(Token* name) {
+    int slot = define_global_slot(copy_string_with_hash(name->start, name->length, name->hash));
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return (uint16_t) slot;
+}
+
+static void emit_global(uint8_t instruction, uint16_t slot) {
+    emit_byte(instruction);
+    emit_byte((slot >> 8) & 0xff);
+    emit_byte(slot & 0xff);
 }
 
 static bool identifiers_equal(Token* a, Token* b) {
-    if (a->length != b->length) return false;
+    if (a->length != b->length || a->hash != b->hash) return false;
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
@@ -283,13 +509,13 @@ static void declare_variable() {
     add_local(*name);
 }
 
-static uint8_t parse_variable(const char* err_message) {
+static uint16_t parse_variable(const char* err_message) {
     consume(TOKEN_IDENTIFIER, err_message);
 
     declare_variable();
     if (current->scope_depth > 0) return 0;
 
-    return identifier_constant(&parser.prev);
+    return global_slot(&parser.prev);
 }
 
 static void mark_as_initialized() {
@@ -297,12 +523,12 @@ static void mark_as_initialized() {
     current->locals[current->local_count-1].depth = current->scope_depth;
 }
 
-static void define_variable(uint8_t global) {
+static void define_variable(uint16_t global) {
     if (current->scope_depth > 0) {
         mark_as_initialized();
         return;
     }
-    emit_bytes(OP_DEFINE_GLOBAL, global);
+    emit_global(OP_DEFINE_GLOBAL, global);
 }
 
 static void and_(bool can_assign) {
@@ -316,9 +542,21 @@ static void and_(bool can_assign) {
 
 static void binary(bool can_assign) {
     TokenType operator_type = parser.prev.type;
+    int left_start = parser.operand_start;
+    int right_start = get_current_chunk()->count;
     ParseRule* rule = get_rule(operator_type);
     parse_precedence((Precedence) (rule->precedence+1));
 
+    Value a, b, result;
+    if (constant_between(left_start, right_start, &a) &&
+        constant_since(right_start, &b) &&
+        fold_binary(operator_type, a, b, &result)) {
+        replace_with_constant(left_start, result);
+        return;
+    }
+
+    if (operator_type == TOKEN_PLUS && emit_add_locals(left_start, right_start)) return;
+
     switch (operator_type) {
         case TOKEN_BANG_EQUAL:      emit_bytes(OP_EQUAL, OP_NOT); break;
         case TOKEN_EQUAL_EQUAL:     emit_byte(OP_EQUAL); break;
@@ -367,7 +605,7 @@ static void function(FunctionType type) {
                 error_at_curr("Can't have more than 255 parameters.");
             }
 
-            uint8_t constant = parse_variable("Expect parameter name");
+            uint16_t constant = parse_variable("Expect parameter name");
             define_variable(constant);
         } while (is_match(TOKEN_COMMA));
     }
@@ -381,14 +619,14 @@ static void function(FunctionType type) {
 }
 
 static void function_declaration() {
-    uint8_t global = parse_variable("Expect function name");
+    uint16_t global = parse_variable("Expect function name");
     mark_as_initialized();
     function(TYPE_FUNCTION);
     define_variable(global);
 }
 
 static void variable_declaration() {
-    uint8_t global = parse_variable("Expect variable name");
+    uint16_t global = parse_variable("Expect variable name");
 
     if (is_match(TOKEN_EQUAL)) {
         expression();
@@ -407,17 +645,19 @@ static void expression_statement() {
 
 static void if_statement() {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after if.");
+    int condition_start = get_current_chunk()->count;
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after if.");
 
-    int then_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    bool fused;
+    int then_jump = emit_condition_jump(condition_start, &fused);
+    if (!fused) emit_byte(OP_POP);
     statement();
 
     int else_jump = emit_jump(OP_JUMP);
 
     patch_jump(then_jump);
-    emit_byte(OP_POP);
+    if (!fused) emit_byte(OP_POP);
 
     if (is_match(TOKEN_ELSE )) statement();
     patch_jump(else_jump);
@@ -435,13 +675,14 @@ static void while_statement() {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    bool fused;
+    int exit_jump = emit_condition_jump(loop_start, &fused);
+    if (!fused) emit_byte(OP_POP);
     statement();
     emit_loop(loop_start);
 
     patch_jump(exit_jump);
-    emit_byte(OP_POP);
+    if (!fused) emit_byte(OP_POP);
 }
 
 static void for_statement() {
@@ -458,12 +699,13 @@ static void for_statement() {
 
     int loop_start = get_current_chunk()->count;
     int exit_jump = -1;
+    bool fused = false;
     if (!is_match(TOKEN_SEMICOLON)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition");
 
-        exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-        emit_byte(OP_POP);
+        exit_jump = emit_condition_jump(loop_start, &fused);
+        if (!fused) emit_byte(OP_POP);
     }
 
     if (!is_match(TOKEN_RIGHT_PAREN)) {
@@ -484,7 +726,7 @@ static void for_statement() {
 
     if (exit_jump != -1) {
         patch_jump(exit_jump);
-        emit_byte(OP_POP);
+        if (!fused) emit_byte(OP_POP);
     }
 
     end_scope();
@@ -550,8 +792,56 @@ static void grouping(bool can_assign) {
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression");
 }
 
+// Powers of ten that a double represents exactly.
+static const double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+#define MAX_EXACT_MANTISSA (UINT64_C(1) << 53)
+#define MAX_FAST_DIGITS 19 // Any 19 decimal digits fit in a uint64_t.
+
+static double parse_number_slow(const char* start, int length) {
+    char small[64];
+    char* buffer = length < (int) sizeof(small) ? small : malloc(length + 1);
+    if (buffer == NULL) exit(1);
+
+    memcpy(buffer, start, length);
+    buffer[length] = '\0';
+    double value = strtod(buffer, NULL);
+
+    if (buffer != small) free(buffer);
+    return value;
+}
+
+// Parses a literal of the scanner's form digits[.digits], reading exactly
+// the token's bytes. If the digits fit in 53 bits and at most 22 follow the
+// point, the digits and the power of ten are both exact doubles, so one
+// IEEE division rounds correctly (Clinger's fast path). Longer literals are
+// left to strtod.
+static double parse_number(const char* start, int length) {
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int fraction_digits = 0;
+    bool in_fraction = false;
+
+    for (int i = 0; i < length; i++) {
+        if (start[i] == '.') {
+            in_fraction = true;
+            continue;
+        }
+        if (++digits > MAX_FAST_DIGITS) return parse_number_slow(start, length);
+        mantissa = mantissa * 10 + (uint64_t) (start[i] - '0');
+        fraction_digits += in_fraction;
+    }
+
+    if (mantissa > MAX_EXACT_MANTISSA || fraction_digits > 22) return parse_number_slow(start, length);
+    if (fraction_digits == 0) return (double) mantissa;
+    return (double) mantissa / exact_powers_of_ten[fraction_digits];
+}
+
 static void number(bool can_assign) {
-    double val = strtod(parser.prev.start, NULL);
+    double val = parse_number(parser.prev.start, parser.prev.length);
     emit_constant(NUMBER_VAL(val));
 }
 
@@ -571,23 +861,27 @@ static void string(bool can_assign) {
 }
 
 static void named_variable(Token name, bool can_assign) {
-    uint8_t get_op, set_op;
     int arg = resolve_local(current, &name);
 
     if (arg != -1) {
-        get_op = OP_GET_LOCAL;
-        set_op = OP_SET_LOCAL;
-    } else {
-        arg = identifier_constant(&name);
-        get_op = OP_GET_GLOBAL;
-        set_op = OP_SET_GLOBAL;
+        if (can_assign && is_match(TOKEN_EQUAL)) {
+            int start = get_current_chunk()->count;
+            expression();
+            if (emit_increment_local(start, (uint8_t) arg)) return;
+            if (emit_register_op(start, (uint8_t) arg)) return;
+            emit_bytes(OP_SET_LOCAL, (uint8_t) arg);
+        } else {
+            emit_bytes(OP_GET_LOCAL, (uint8_t) arg);
+        }
+        return;
     }
 
+    uint16_t slot = global_slot(&name);
     if (can_assign && is_match(TOKEN_EQUAL)) {
         expression();
-        emit_bytes(set_op, (uint8_t) arg);
+        emit_global(OP_SET_GLOBAL, slot);
     } else {
-        emit_bytes(get_op, (uint8_t) arg);
+        emit_global(OP_GET_GLOBAL, slot);
     }
 }
 
@@ -597,10 +891,23 @@ static void variable(bool can_assign) {
 
 static void unary(bool can_assign) {
     TokenType operator_type = parser.prev.type;
+    int operand_start = get_current_chunk()->count;
 
     // Compile the operand
     parse_precedence(PREC_UNARY);
 
+    Value operand;
+    if (constant_since(operand_start, &operand)) {
+        if (operator_type == TOKEN_BANG) {
+            replace_with_constant(operand_start, BOOL_VAL(is_falsey_constant(operand)));
+            return;
+        }
+        if (operator_type == TOKEN_MINUS && IS_NUMBER(operand)) {
+            replace_with_constant(operand_start, NUMBER_VAL(-AS_NUMBER(operand)));
+            return;
+        }
+    }
+
     // Emit the operator instruction
     switch (operator_type) {
         case TOKEN_BANG: emit_byte(OP_NOT); break;
@@ -660,12 +967,14 @@ static void parse_precedence(Precedence precedence) {
         return;
     }
 
+    int start = get_current_chunk()->count;
     bool can_assign = precedence <= PREC_ASSIGNMENT;
     prefix_rule(can_assign);
 
     while (precedence <= get_rule(parser.curr.type)->precedence) {
         advance();
         ParseFn infix_rule = get_rule(parser.prev.type)->infix;
+        parser.operand_start = start;
         infix_rule(can_assign);
     }
 
@@ -678,9 +987,7 @@ static ParseRule* get_rule(TokenType type) {
     return &rules[type];
 }
 
-ObjFunction* compile(const char* src) {
-    init_scanner(src);
-
+static ObjFunction* compile_tokens() {
     Compiler compiler;
     init_compiler(&compiler, TYPE_SCRIPT);
 
@@ -693,9 +1000,26 @@ ObjFunction* compile(const char* src) {
         declaration();
     }
 
-    end_compiler();
-
     ObjFunction* function = end_compiler();
     return parser.had_error ? NULL : function;
 }
 
+ObjFunction* compile(const char* src) {
+    init_scanner(src);
+    return compile_tokens();
+}
+
+ObjFunction* compile_stream(ScannerReader read, void* context) {
+    init_scanner_stream(read, context);
+    ObjFunction* function = compile_tokens();
+    free_scanner();
+    return function;
+}
+
+void mark_compiler_roots() {
+    Compiler* compiler = current;
+    while (compiler != NULL) {
+        mark_object((Obj*) compiler->function);
+        compiler = compiler->enclosing;
+    }
+}
@@ -10,8 +10,11 @@
 
 #include "chunk.h"
 #include "object.h"
+#include "scanner.h"
 #include "vm.h"
 
 ObjFunction* compile(const char* src);
+ObjFunction* compile_stream(ScannerReader read, void* context);
+void mark_compiler_roots();
 
 #endif //FAVE_CUH_COMPILER_H
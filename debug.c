@@ -6,6 +6,7 @@
 
 #include "debug.h"
 #include "value.h"
+#include "vm.h"
 
 int constant_instruction(const char* name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset+1];
@@ -21,15 +22,60 @@ int simple_instruction(const char* name, int offset) {
 }
 
 int byte_instruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t slot = chunk->code[offset-1];
+    uint8_t slot = chunk->code[offset+1];
     printf("%-16s %4d\n", name, slot);
     return offset+2;
 }
 
+static int global_instruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t) (chunk->code[offset+1] << 8);
+    slot |= chunk->code[offset+2];
+    printf("%-16s %4d '%s'\n", name, slot, global_slot_name(slot)->chars);
+    return offset+3;
+}
+
+static int two_byte_instruction(const char* name, Chunk* chunk, int offset) {
+    printf("%-16s %4d %4d\n", name, chunk->code[offset+1], chunk->code[offset+2]);
+    return offset+3;
+}
+
+static int local_constant_instruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset+1];
+    uint8_t constant = chunk->code[offset+2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset+3;
+}
+
+static int local_constant_jump_instruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset+1];
+    uint8_t constant = chunk->code[offset+2];
+    uint16_t jump = (uint16_t) (chunk->code[offset+3] << 8);
+    jump |= chunk->code[offset+4];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("' -> %d\n", offset+5+jump);
+    return offset+5;
+}
+
+static int register_instruction(const char* name, Chunk* chunk, int offset) {
+    printf("%-16s %4d %4d %4d\n", name, chunk->code[offset+1], chunk->code[offset+2], chunk->code[offset+3]);
+    return offset+4;
+}
+
+static int register_constant_instruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset+3];
+    printf("%-16s %4d %4d %4d '", name, chunk->code[offset+1], chunk->code[offset+2], constant);
+    print_value(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset+4;
+}
+
 static int jump_instruction(const char* name, int sign, Chunk* chunk, int offset) {
     uint16_t jump = (uint16_t) (chunk->code[offset+1] << 8);
     jump |= chunk->code[offset+2];
-    printf("%-16s %4d -> %d\n", name, offset, offset+3+sign+jump);
+    printf("%-16s %4d -> %d\n", name, offset, offset+3+sign*jump);
     return offset+3;
 }
 
@@ -73,6 +119,48 @@ int disassemble_instruction(Chunk* chunk, int offset) {
             return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP:
             return jump_instruction("OP_LOOP", -1, chunk, offset);
+        case OP_ADD_LOCAL_LOCAL:
+            return two_byte_instruction("OP_ADD_LOCAL_LOCAL", chunk, offset);
+        case OP_INCREMENT_LOCAL:
+            return local_constant_instruction("OP_INCREMENT_LOCAL", chunk, offset);
+        case OP_INCREMENT_LOCAL_POP:
+            return local_constant_instruction("OP_INCREMENT_LOCAL_POP", chunk, offset);
+        case OP_DECREMENT_LOCAL:
+            return local_constant_instruction("OP_DECREMENT_LOCAL", chunk, offset);
+        case OP_DECREMENT_LOCAL_POP:
+            return local_constant_instruction("OP_DECREMENT_LOCAL_POP", chunk, offset);
+        case OP_JUMP_UNLESS_LESS_LOCAL:
+            return local_constant_jump_instruction("OP_JUMP_UNLESS_LESS_LOCAL", chunk, offset);
+        case OP_JUMP_UNLESS_GREATER_LOCAL:
+            return local_constant_jump_instruction("OP_JUMP_UNLESS_GREATER_LOCAL", chunk, offset);
+        case OP_JUMP_IF_LESS_LOCAL:
+            return local_constant_jump_instruction("OP_JUMP_IF_LESS_LOCAL", chunk, offset);
+        case OP_JUMP_IF_GREATER_LOCAL:
+            return local_constant_jump_instruction("OP_JUMP_IF_GREATER_LOCAL", chunk, offset);
+        case OP_ADD_REG_REG:
+            return register_instruction("OP_ADD_REG_REG", chunk, offset);
+        case OP_ADD_REG_CONST:
+            return register_constant_instruction("OP_ADD_REG_CONST", chunk, offset);
+        case OP_SUBTRACT_REG_REG:
+            return register_instruction("OP_SUBTRACT_REG_REG", chunk, offset);
+        case OP_SUBTRACT_REG_CONST:
+            return register_constant_instruction("OP_SUBTRACT_REG_CONST", chunk, offset);
+        case OP_MULTIPLY_REG_REG:
+            return register_instruction("OP_MULTIPLY_REG_REG", chunk, offset);
+        case OP_MULTIPLY_REG_CONST:
+            return register_constant_instruction("OP_MULTIPLY_REG_CONST", chunk, offset);
+        case OP_DIVIDE_REG_REG:
+            return register_instruction("OP_DIVIDE_REG_REG", chunk, offset);
+        case OP_DIVIDE_REG_CONST:
+            return register_constant_instruction("OP_DIVIDE_REG_CONST", chunk, offset);
+        case OP_ADD_NUM:
+            return simple_instruction("OP_ADD_NUM", offset);
+        case OP_ADD_STR:
+            return simple_instruction("OP_ADD_STR", offset);
+        case OP_EQUAL_NUM:
+            return simple_instruction("OP_EQUAL_NUM", offset);
+        case OP_NOT_EQUAL_NUM:
+            return simple_instruction("OP_NOT_EQUAL_NUM", offset);
         case OP_RETURN:
             return simple_instruction("OP_RETURN", offset);
         case OP_NIL:
@@ -85,20 +173,28 @@ int disassemble_instruction(Chunk* chunk, int offset) {
             return byte_instruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
             return byte_instruction("OP_SET_LOCAL", chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byte_instruction("OP_SET_LOCAL_POP", chunk, offset);
         case OP_GET_GLOBAL:
-            return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+            return global_instruction("OP_GET_GLOBAL", chunk, offset);
         case OP_FALSE:
             return simple_instruction("OP_FALSE", offset);
         case OP_DEFINE_GLOBAL:
-            return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return global_instruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+            return global_instruction("OP_SET_GLOBAL", chunk, offset);
         case OP_EQUAL:
             return simple_instruction("OP_EQUAL", offset);
         case OP_GREATER:
             return simple_instruction("OP_GREATER", offset);
         case OP_LESS:
             return simple_instruction("OP_LESS", offset);
+        case OP_NOT_EQUAL:
+            return simple_instruction("OP_NOT_EQUAL", offset);
+        case OP_GREATER_EQUAL:
+            return simple_instruction("OP_GREATER_EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return simple_instruction("OP_LESS_EQUAL", offset);
         default:
             printf("Unkown opcode %d\n", instruction);
             return offset+1;
@@ -0,0 +1,418 @@
+//
+// Created by Fabian Simon on 17.10.26.
+//
+
+#include "jit.h"
+
+#ifdef JIT
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "optimizer.h"
+
+// A baseline template JIT. Each instruction becomes a fixed machine-code
+// template that calls a helper for the instruction's fast path, and jumps
+// become native jumps, so no instruction is ever dispatched. A helper that
+// meets anything off its fast path returns 0 before changing any state, and
+// the template hands that instruction back to the interpreter.
+
+typedef int (*JitHelper)(CallFrame* frame, const uint8_t* operands);
+
+#define HELPER(name) static int name(CallFrame* frame, const uint8_t* operands)
+#define CONSTANT(index) (frame->function->chunk.constants.values[index])
+#define SLOT(index) (frame->slots[index])
+#define TOP(distance) (vm.stack_top[-1 - (distance)])
+#define GLOBAL_SLOT() ((operands[0] << 8) | operands[1])
+
+// Results of the helpers behind compare-and-branch instructions.
+#define JUMP_NOT_TAKEN 0
+#define JUMP_TAKEN 1
+#define JUMP_BAIL 2
+
+HELPER(jit_constant)        { push(CONSTANT(operands[0])); return 1; }
+HELPER(jit_nil)             { push(NIL_VAL); return 1; }
+HELPER(jit_true)            { push(BOOL_VAL(true)); return 1; }
+HELPER(jit_false)           { push(BOOL_VAL(false)); return 1; }
+HELPER(jit_pop)             { pop(); return 1; }
+HELPER(jit_get_local)       { push(SLOT(operands[0])); return 1; }
+HELPER(jit_set_local)       { SLOT(operands[0]) = TOP(0); return 1; }
+HELPER(jit_set_local_pop)   { SLOT(operands[0]) = pop(); return 1; }
+HELPER(jit_not)             { TOP(0) = BOOL_VAL(is_falsey(TOP(0))); return 1; }
+HELPER(jit_jump_if_false)   { return is_falsey(TOP(0)); }
+
+HELPER(jit_print) {
+    print_value(pop());
+    printf("\n");
+    return 1;
+}
+
+HELPER(jit_get_global) {
+    Value val = vm.global_values.values[GLOBAL_SLOT()];
+    if (IS_UNDEFINED(val)) return 0;
+    push(val);
+    return 1;
+}
+
+HELPER(jit_define_global) {
+    vm.global_values.values[GLOBAL_SLOT()] = pop();
+    return 1;
+}
+
+HELPER(jit_set_global) {
+    Value* global = &vm.global_values.values[GLOBAL_SLOT()];
+    if (IS_UNDEFINED(*global)) return 0;
+    *global = TOP(0);
+    return 1;
+}
+
+// Ropes are flattened before comparing, which allocates; leave that to the interpreter.
+HELPER(jit_equal) {
+    if (IS_ROPE(TOP(0)) || IS_ROPE(TOP(1))) return 0;
+    Value b = pop();
+    TOP(0) = BOOL_VAL(values_equal(TOP(0), b));
+    return 1;
+}
+
+HELPER(jit_not_equal) {
+    if (IS_ROPE(TOP(0)) || IS_ROPE(TOP(1))) return 0;
+    Value b = pop();
+    TOP(0) = BOOL_VAL(!values_equal(TOP(0), b));
+    return 1;
+}
+
+HELPER(jit_negate) {
+    if (!IS_NUMBER(TOP(0))) return 0;
+    TOP(0) = NUMBER_VAL(-AS_NUMBER(TOP(0)));
+    return 1;
+}
+
+#define NUMBER_HELPER(name, value_type, result) \
+    HELPER(name) { \
+        if (!IS_NUMBER(TOP(0)) || !IS_NUMBER(TOP(1))) return 0; \
+        double y = AS_NUMBER(pop()); \
+        double x = AS_NUMBER(TOP(0)); \
+        TOP(0) = value_type(result); \
+        return 1; \
+    }
+
+NUMBER_HELPER(jit_add, NUMBER_VAL, x + y)
+NUMBER_HELPER(jit_subtract, NUMBER_VAL, x - y)
+NUMBER_HELPER(jit_multiply, NUMBER_VAL, x * y)
+NUMBER_HELPER(jit_divide, NUMBER_VAL, x / y)
+NUMBER_HELPER(jit_greater, BOOL_VAL, x > y)
+NUMBER_HELPER(jit_less, BOOL_VAL, x < y)
+NUMBER_HELPER(jit_greater_equal, BOOL_VAL, !(x < y))
+NUMBER_HELPER(jit_less_equal, BOOL_VAL, !(x > y))
+
+HELPER(jit_add_local_local) {
+    Value a = SLOT(operands[0]);
+    Value b = SLOT(operands[1]);
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return 0;
+    push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+    return 1;
+}
+
+HELPER(jit_increment_local_pop) {
+    Value val = SLOT(operands[0]);
+    Value k = CONSTANT(operands[1]);
+    if (!IS_NUMBER(val) || !IS_NUMBER(k)) return 0;
+    SLOT(operands[0]) = NUMBER_VAL(AS_NUMBER(val) + AS_NUMBER(k));
+    return 1;
+}
+
+HELPER(jit_increment_local) {
+    if (!jit_increment_local_pop(frame, operands)) return 0;
+    push(SLOT(operands[0]));
+    return 1;
+}
+
+HELPER(jit_decrement_local_pop) {
+    Value val = SLOT(operands[0]);
+    Value k = CONSTANT(operands[1]);
+    if (!IS_NUMBER(val) || !IS_NUMBER(k)) return 0;
+    SLOT(operands[0]) = NUMBER_VAL(AS_NUMBER(val) - AS_NUMBER(k));
+    return 1;
+}
+
+HELPER(jit_decrement_local) {
+    if (!jit_decrement_local_pop(frame, operands)) return 0;
+    push(SLOT(operands[0]));
+    return 1;
+}
+
+#define REGISTER_HELPER(name, op, b) \
+    HELPER(name) { \
+        Value a = SLOT(operands[1]); \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) return 0; \
+        SLOT(operands[0]) = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+        return 1; \
+    }
+
+REGISTER_HELPER(jit_add_reg_reg, +, SLOT(operands[2]))
+REGISTER_HELPER(jit_add_reg_const, +, CONSTANT(operands[2]))
+REGISTER_HELPER(jit_subtract_reg_reg, -, SLOT(operands[2]))
+REGISTER_HELPER(jit_subtract_reg_const, -, CONSTANT(operands[2]))
+REGISTER_HELPER(jit_multiply_reg_reg, *, SLOT(operands[2]))
+REGISTER_HELPER(jit_multiply_reg_const, *, CONSTANT(operands[2]))
+REGISTER_HELPER(jit_divide_reg_reg, /, SLOT(operands[2]))
+REGISTER_HELPER(jit_divide_reg_const, /, CONSTANT(operands[2]))
+
+#define LOCAL_JUMP_HELPER(name, op, jump_if) \
+    HELPER(name) { \
+        Value a = SLOT(operands[0]); \
+        Value b = CONSTANT(operands[1]); \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) return JUMP_BAIL; \
+        return (AS_NUMBER(a) op AS_NUMBER(b)) == jump_if ? JUMP_TAKEN : JUMP_NOT_TAKEN; \
+    }
+
+LOCAL_JUMP_HELPER(jit_jump_unless_less_local, <, false)
+LOCAL_JUMP_HELPER(jit_jump_unless_greater_local, >, false)
+LOCAL_JUMP_HELPER(jit_jump_if_less_local, <, true)
+LOCAL_JUMP_HELPER(jit_jump_if_greater_local, >, true)
+
+static JitHelper helper_for(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:                   return jit_constant;
+        case OP_NIL:                        return jit_nil;
+        case OP_TRUE:                       return jit_true;
+        case OP_FALSE:                      return jit_false;
+        case OP_POP:                        return jit_pop;
+        case OP_GET_LOCAL:                  return jit_get_local;
+        case OP_GET_GLOBAL:                 return jit_get_global;
+        case OP_DEFINE_GLOBAL:              return jit_define_global;
+        case OP_SET_LOCAL:                  return jit_set_local;
+        case OP_SET_LOCAL_POP:              return jit_set_local_pop;
+        case OP_SET_GLOBAL:                 return jit_set_global;
+        case OP_EQUAL:
+        case OP_EQUAL_NUM:                  return jit_equal;
+        case OP_GREATER:                    return jit_greater;
+        case OP_LESS:                       return jit_less;
+        case OP_NOT_EQUAL:
+        case OP_NOT_EQUAL_NUM:              return jit_not_equal;
+        case OP_GREATER_EQUAL:              return jit_greater_equal;
+        case OP_LESS_EQUAL:                 return jit_less_equal;
+        case OP_ADD:
+        case OP_ADD_NUM:                    return jit_add;
+        case OP_SUBTRACT:                   return jit_subtract;
+        case OP_MULTIPLY:                   return jit_multiply;
+        case OP_DIVIDE:                     return jit_divide;
+        case OP_NOT:                        return jit_not;
+        case OP_NEGATE:                     return jit_negate;
+        case OP_PRINT:                      return jit_print;
+        case OP_JUMP_IF_FALSE:              return jit_jump_if_false;
+        case OP_ADD_LOCAL_LOCAL:            return jit_add_local_local;
+        case OP_INCREMENT_LOCAL:            return jit_increment_local;
+        case OP_INCREMENT_LOCAL_POP:        return jit_increment_local_pop;
+        case OP_DECREMENT_LOCAL:            return jit_decrement_local;
+        case OP_DECREMENT_LOCAL_POP:        return jit_decrement_local_pop;
+        case OP_JUMP_UNLESS_LESS_LOCAL:     return jit_jump_unless_less_local;
+        case OP_JUMP_UNLESS_GREATER_LOCAL:  return jit_jump_unless_greater_local;
+        case OP_JUMP_IF_LESS_LOCAL:         return jit_jump_if_less_local;
+        case OP_JUMP_IF_GREATER_LOCAL:      return jit_jump_if_greater_local;
+        case OP_ADD_REG_REG:                return jit_add_reg_reg;
+        case OP_ADD_REG_CONST:              return jit_add_reg_const;
+        case OP_SUBTRACT_REG_REG:           return jit_subtract_reg_reg;
+        case OP_SUBTRACT_REG_CONST:         return jit_subtract_reg_const;
+        case OP_MULTIPLY_REG_REG:           return jit_multiply_reg_reg;
+        case OP_MULTIPLY_REG_CONST:         return jit_multiply_reg_const;
+        case OP_DIVIDE_REG_REG:             return jit_divide_reg_reg;
+        case OP_DIVIDE_REG_CONST:           return jit_divide_reg_const;
+        default:                            return NULL;
+    }
+}
+
+// Upper bounds on the bytes one instruction's template and its bail stub take.
+#define MAX_TEMPLATE_SIZE 48
+#define MAX_STUB_SIZE 32
+
+typedef struct {
+    int position; // Where the rel32 to patch starts.
+    int target;   // Bytecode offset it refers to.
+} Fixup;
+
+typedef struct {
+    uint8_t* code;
+    int count;
+    Fixup* jumps;
+    int jump_count;
+    Fixup* bails;
+    int bail_count;
+} Assembler;
+
+static void emit8(Assembler* as, uint8_t byte) {
+    as->code[as->count++] = byte;
+}
+
+static void emit_bytes2(Assembler* as, uint8_t a, uint8_t b) {
+    emit8(as, a);
+    emit8(as, b);
+}
+
+static void emit_bytes3(Assembler* as, uint8_t a, uint8_t b, uint8_t c) {
+    emit_bytes2(as, a, b);
+    emit8(as, c);
+}
+
+static void emit32(Assembler* as, uint32_t value) {
+    memcpy(&as->code[as->count], &value, sizeof(value));
+    as->count += sizeof(value);
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+    memcpy(&as->code[as->count], &value, sizeof(value));
+    as->count += sizeof(value);
+}
+
+static void patch_rel32(Assembler* as, int position, int target) {
+    int32_t rel = target - (position + 4);
+    memcpy(&as->code[position], &rel, sizeof(rel));
+}
+
+// Emits the rel32 of a jump to the native code for a bytecode offset.
+static void emit_jump_to(Assembler* as, int target) {
+    as->jumps[as->jump_count++] = (Fixup) {as->count, target};
+    emit32(as, 0);
+}
+
+// Emits the rel32 of a jump that hands the instruction at offset back to the interpreter.
+static void emit_bail_to(Assembler* as, int offset) {
+    as->bails[as->bail_count++] = (Fixup) {as->count, offset};
+    emit32(as, 0);
+}
+
+// helper(frame, operands), with the frame kept in rbx.
+static void emit_helper_call(Assembler* as, JitHelper helper, const uint8_t* operands) {
+    emit_bytes3(as, 0x48, 0x89, 0xdf);                  // mov rdi, rbx
+    emit_bytes2(as, 0x48, 0xbe);                        // movabs rsi, operands
+    emit64(as, (uint64_t) (uintptr_t) operands);
+    emit_bytes2(as, 0x48, 0xb8);                        // movabs rax, helper
+    emit64(as, (uint64_t) (uintptr_t) helper);
+    emit_bytes2(as, 0xff, 0xd0);                        // call rax
+}
+
+static void emit_instruction(Assembler* as, Chunk* chunk, int offset) {
+    uint8_t instruction = chunk->code[offset];
+    const uint8_t* operands = &chunk->code[offset+1];
+    JitHelper helper = helper_for(instruction);
+
+    switch (instruction) {
+        case OP_JUMP:
+        case OP_LOOP:
+            emit8(as, 0xe9);                            // jmp target
+            emit_jump_to(as, jump_target(chunk, offset));
+            return;
+        case OP_JUMP_IF_FALSE:
+            emit_helper_call(as, helper, operands);
+            emit_bytes2(as, 0x85, 0xc0);                // test eax, eax
+            emit_bytes2(as, 0x0f, 0x85);                // jnz target
+            emit_jump_to(as, jump_target(chunk, offset));
+            return;
+        case OP_JUMP_UNLESS_LESS_LOCAL:
+        case OP_JUMP_UNLESS_GREATER_LOCAL:
+        case OP_JUMP_IF_LESS_LOCAL:
+        case OP_JUMP_IF_GREATER_LOCAL:
+            emit_helper_call(as, helper, operands);
+            emit_bytes3(as, 0x83, 0xf8, JUMP_TAKEN);    // cmp eax, JUMP_TAKEN
+            emit_bytes2(as, 0x0f, 0x84);                // je target
+            emit_jump_to(as, jump_target(chunk, offset));
+            emit_bytes2(as, 0x0f, 0x87);                // ja bail
+            emit_bail_to(as, offset);
+            return;
+        default:
+            break;
+    }
+
+    if (helper == NULL) {
+        emit8(as, 0xe9);                                // jmp bail
+        emit_bail_to(as, offset);
+        return;
+    }
+
+    emit_helper_call(as, helper, operands);
+    emit_bytes2(as, 0x85, 0xc0);                        // test eax, eax
+    emit_bytes2(as, 0x0f, 0x84);                        // jz bail
+    emit_bail_to(as, offset);
+}
+
+void jit_compile(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t size = (size_t) chunk->count * (MAX_TEMPLATE_SIZE + MAX_STUB_SIZE) + MAX_TEMPLATE_SIZE;
+    size = (size + page-1) / page * page;
+
+    uint8_t* code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return;
+
+    int* entries = ALLOCATE(int, chunk->count);
+    Assembler as = {code, 0, ALLOCATE(Fixup, chunk->count), 0, ALLOCATE(Fixup, chunk->count), 0};
+
+    // Entered as native(frame, entry): keep the frame in rbx and jump to the entry.
+    emit8(&as, 0x53);                                   // push rbx
+    emit_bytes3(&as, 0x48, 0x89, 0xfb);                 // mov rbx, rdi
+    emit_bytes2(&as, 0xff, 0xe6);                       // jmp rsi
+
+    int exit = as.count;
+    emit8(&as, 0x5b);                                   // pop rbx
+    emit8(&as, 0xc3);                                   // ret
+
+    for (int offset = 0; offset < chunk->count; offset++) entries[offset] = -1;
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk->code[offset])) {
+        entries[offset] = as.count;
+        emit_instruction(&as, chunk, offset);
+    }
+
+    // Each bail stores the instruction's address as the frame's ip and returns to the interpreter.
+    for (int i = 0; i < as.bail_count; i++) {
+        patch_rel32(&as, as.bails[i].position, as.count);
+        emit_bytes2(&as, 0x48, 0xb8);                   // movabs rax, ip
+        emit64(&as, (uint64_t) (uintptr_t) &chunk->code[as.bails[i].target]);
+        emit_bytes3(&as, 0x48, 0x89, 0x83);             // mov [rbx + offsetof(CallFrame, ip)], rax
+        emit32(&as, (uint32_t) offsetof(CallFrame, ip));
+        emit8(&as, 0xe9);                               // jmp exit
+        patch_rel32(&as, as.count, exit);
+        as.count += 4;
+    }
+
+    for (int i = 0; i < as.jump_count; i++) {
+        patch_rel32(&as, as.jumps[i].position, entries[as.jumps[i].target]);
+    }
+
+    FREE_ARRAY(Fixup, as.jumps, chunk->count);
+    FREE_ARRAY(Fixup, as.bails, chunk->count);
+
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, size);
+        FREE_ARRAY(int, entries, chunk->count);
+        return;
+    }
+
+    JitCode* jit = ALLOCATE(JitCode, 1);
+    jit->code = code;
+    jit->size = size;
+    jit->entries = entries;
+    jit->count = chunk->count;
+    function->jit = jit;
+}
+
+void jit_enter(CallFrame* frame) {
+    JitCode* jit = frame->function->jit;
+    int entry = jit->entries[frame->ip - frame->function->chunk.code];
+    if (entry < 0) return;
+
+    void (*native)(CallFrame*, uint8_t*) = (void (*)(CallFrame*, uint8_t*)) (uintptr_t) jit->code;
+    native(frame, jit->code + entry);
+}
+
+void jit_free(JitCode* jit) {
+    if (jit == NULL) return;
+
+    munmap(jit->code, jit->size);
+    FREE_ARRAY(int, jit->entries, jit->count);
+    FREE(JitCode, jit);
+}
+
+#endif
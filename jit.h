@@ -0,0 +1,24 @@
+//
+// Created by Fabian Simon on 17.10.26.
+//
+
+#ifndef FAVE_CUH_JIT_H
+#define FAVE_CUH_JIT_H
+
+#include "vm.h"
+
+// Loop back-edges a function takes in the interpreter before it is compiled.
+#define JIT_THRESHOLD 1000
+
+typedef struct JitCode {
+    uint8_t* code;
+    size_t size;
+    int* entries; // Native offset for each bytecode offset, -1 inside an instruction.
+    int count;
+} JitCode;
+
+void jit_compile(ObjFunction* function);
+void jit_enter(CallFrame* frame);
+void jit_free(JitCode* jit);
+
+#endif //FAVE_CUH_JIT_H
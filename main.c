@@ -1,36 +1,80 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "bytecode.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
 #include "vm.h"
 
 static void repl() {
-    char line[1024];
+    char* line = NULL;
+    size_t capacity = 0;
     for (;;) {
         printf("> ");
-        if (!fgets(line, sizeof(line), stdin)) {
+        if (getline(&line, &capacity, stdin) == -1) {
             printf("\n");
             break;
         }
 
         interpret(line);
     }
+    free(line);
 }
 
-static char* read_file(const char* path) {
-    FILE* file = fopen(path, "rb");
+typedef struct {
+    char* chars;
+    size_t mapped_size; // Bytes mapped for chars, 0 if they were read into the heap.
+} SourceFile;
 
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
+// Maps the file read-only so the scanner reads it straight from the page
+// cache. The mapping reserves at least one byte past the end of the file,
+// and every byte there is zero, which gives the scanner its NUL sentinel
+// without copying anything.
+static bool map_file(int fd, size_t file_size, SourceFile* source) {
+    if (file_size == 0) return false;
+
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t mapped_size = (file_size + 1 + page-1) / page * page;
+
+    // Reserve zeroed pages first, then lay the file over the front of them.
+    void* base = mmap(NULL, mapped_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base != MAP_FAILED &&
+        mmap(base, file_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, mapped_size);
+        base = MAP_FAILED;
+    }
+    if (base == MAP_FAILED) return false;
+
+    source->chars = (char*) base;
+    source->mapped_size = mapped_size;
+    return true;
+}
+
+static size_t read_fd(void* context, char* buffer, size_t size) {
+    int fd = *(int*) context;
+    for (;;) {
+        ssize_t count = read(fd, buffer, size);
+        if (count >= 0) return (size_t) count;
+        if (errno != EINTR) {
+            fprintf(stderr, "Could not read input.\n");
+            exit(74);
+        }
     }
+}
 
-    fseek(file, 0L, SEEK_END);
-    size_t file_size = ftell(file);
-    rewind(file);
+static SourceFile read_file(int fd, size_t file_size, const char* path) {
+    SourceFile source = {NULL, 0};
+    if (map_file(fd, file_size, &source)) return source;
 
     char* buffer = (char*)malloc(file_size+1);
 
@@ -39,42 +83,196 @@ static char* read_file(const char* path) {
         exit(74);
     }
 
-    size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
+    size_t bytes_read = 0;
+    while (bytes_read < file_size) {
+        size_t count = read_fd(&fd, buffer + bytes_read, file_size - bytes_read);
+        if (count == 0) break;
+        bytes_read += count;
+    }
 
     if (bytes_read < file_size) {
         fprintf(stderr, "Could not read file \"%s\".\n", path);
         exit(74);
     }
 
-    buffer[bytes_read] = '\n';
+    buffer[bytes_read] = '\0';
+
+    source.chars = buffer;
+    return source;
+}
+
+static void close_file(SourceFile* source) {
+    if (source->mapped_size > 0) {
+        munmap(source->chars, source->mapped_size);
+    } else {
+        free(source->chars);
+    }
+}
+
+// script.fave caches to script.favec, anything else gets .favec appended.
+static char* cache_path(const char* path) {
+    size_t length = strlen(path);
+    bool is_fave = length >= 5 && strcmp(path + length-5, ".fave") == 0;
+
+    char* cache = (char*) malloc(length + 7);
+    if (cache == NULL) {
+        fprintf(stderr, "Not enough memory to cache \"%s\".\n", path);
+        exit(74);
+    }
+
+    strcpy(cache, path);
+    strcat(cache, is_fave ? "c" : ".favec");
+    return cache;
+}
+
+// Opens path once. A regular file is mapped, or read if it can't be, into
+// source and -1 is returned. Pipes and terminals have no size to map, so
+// their descriptor is returned to compile from as it is read, and "-"
+// always streams stdin.
+static int open_source(const char* path, SourceFile* source) {
+    if (strcmp(path, "-") == 0) return STDIN_FILENO;
+
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+    if (!S_ISREG(info.st_mode)) return fd;
+
+    *source = read_file(fd, (size_t) info.st_size, path);
+    close(fd);
+    return -1;
+}
+
+static ObjFunction* compile_fd(int fd) {
+    ObjFunction* func = compile_stream(read_fd, &fd);
+    if (fd != STDIN_FILENO) close(fd);
+    return func;
+}
+
+static ObjFunction* compile_file(const char* path) {
+    SourceFile source;
+    int fd = open_source(path, &source);
+    if (fd >= 0) return compile_fd(fd);
+
+    ObjFunction* func = compile(source.chars);
+    close_file(&source);
+    return func;
+}
+
+static ObjFunction* compile_cached(const char* path, BytecodeImage* image) {
+    // Streamed sources can't be hashed up front, so they skip the cache.
+    SourceFile source;
+    int fd = open_source(path, &source);
+    if (fd >= 0) return compile_fd(fd);
 
-    fclose(file);
-    return buffer;
+    char* cache = cache_path(path);
+    uint64_t hash = hash_source(source.chars);
+
+    ObjFunction* func = read_bytecode(cache, hash, image);
+    if (func == NULL) {
+        func = compile(source.chars);
+        if (func != NULL) write_bytecode(cache, func, hash);
+    }
+
+    free(cache);
+    close_file(&source);
+    return func;
 }
 
-static void run_file(const char* path) {
-    char* src = read_file(path);
-    InterpretResult result = interpret(src);
-    free(src);
+// With an image, runs through the bytecode cache and leaves the mapped cache file in it.
+static void run_file(const char* path, BytecodeImage* image) {
+    ObjFunction* func = image != NULL ? compile_cached(path, image) : compile_file(path);
+    InterpretResult result = func == NULL ? INTERPRET_COMPILE_ERROR : interpret_function(func);
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+typedef struct {
+    const char* path;
+    Heap heap;
+    ObjFunction* function;
+} CompileJob;
+
+typedef struct {
+    CompileJob* jobs;
+    int count;
+    atomic_int next;
+} CompileQueue;
+
+static void* compile_worker(void* arg) {
+    CompileQueue* queue = (CompileQueue*) arg;
+    for (;;) {
+        int index = atomic_fetch_add(&queue->next, 1);
+        if (index >= queue->count) return NULL;
+
+        CompileJob* job = &queue->jobs[index];
+        init_heap(&job->heap);
+        thread_heap = &job->heap;
+        job->function = compile_file(job->path);
+        thread_heap = NULL;
+    }
+}
+
+// Compiles the files side by side, one heap each, then links and runs them
+// in order in the one VM, so later files see the globals of earlier ones.
+static void run_files(const char* paths[], int count) {
+    CompileQueue queue;
+    queue.jobs = (CompileJob*) calloc(count, sizeof(CompileJob));
+    queue.count = count;
+    atomic_init(&queue.next, 0);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = cpus > count ? count : cpus > 1 ? (int) cpus : 1;
+    pthread_t* threads = (pthread_t*) malloc(sizeof(pthread_t) * thread_count);
+    if (queue.jobs == NULL || threads == NULL) {
+        fprintf(stderr, "Not enough memory to compile %d files.\n", count);
+        exit(74);
+    }
+    for (int i = 0; i < count; i++) queue.jobs[i].path = paths[i];
+
+    // This thread works the queue too, so a failed pthread_create only costs parallelism.
+    int started = 0;
+    while (started < thread_count-1 &&
+           pthread_create(&threads[started], NULL, compile_worker, &queue) == 0) {
+        started++;
+    }
+    compile_worker(&queue);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
 
+    for (int i = 0; i < count; i++) {
+        if (queue.jobs[i].function == NULL) exit(65);
+    }
+
+    for (int i = 0; i < count; i++) {
+        ObjFunction* script = link_heap(&queue.jobs[i].heap, queue.jobs[i].function);
+        if (interpret_function(script) == INTERPRET_RUNTIME_ERROR) exit(70);
+    }
+    free(queue.jobs);
+}
 
 int main(int argc, const char* argv[]) {
+    BytecodeImage image = {NULL, 0};
     init_VM();
 
     if (argc == 1) {
         repl();
     } else if (argc == 2) {
-        run_file(argv[1]);
+        run_file(argv[1], NULL);
+    } else if (argc == 3 && strcmp(argv[1], "--cache") == 0) {
+        run_file(argv[2], &image);
+    } else if (strcmp(argv[1], "--cache") != 0) {
+        run_files(argv + 1, argc - 1);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [--cache] [path | -]\n"
+                        "       clox path...\n");
         exit(64);
     }
 
     free_VM();
+    close_bytecode(&image);
     return 0;
 }
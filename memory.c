@@ -4,11 +4,36 @@
 
 #include <stdlib.h>
 
+#include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
 #include "vm.h"
 
+#ifdef DEBUG_LOG_GC
+#include <stdio.h>
+#include "debug.h"
+#endif
+
+#define GC_HEAP_GROW_FACTOR 2
+
 void* reallocate(void* pointer, size_t old_size, size_t new_size) {
+    if (thread_heap != NULL) {
+        thread_heap->bytes_allocated += new_size - old_size;
+    } else {
+        vm.bytes_allocated += new_size - old_size;
+    }
+
+    if (new_size > old_size && !vm.collecting_nursery && thread_heap == NULL) {
+#ifdef DEBUG_STRESS_GC
+        collect_garbage();
+#endif
+
+        if (vm.bytes_allocated > vm.next_GC) {
+            collect_garbage();
+        }
+    }
+
     if (new_size == 0) {
         free(pointer);
         return NULL;
@@ -19,23 +44,198 @@ void* reallocate(void* pointer, size_t old_size, size_t new_size) {
     return result;
 }
 
+static void push_gray(Obj* object) {
+    if (vm.gray_capacity < vm.gray_count+1) {
+        vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
+        // The gray stack is owned by the collector itself, so it bypasses reallocate().
+        vm.gray_stack = (Obj**) realloc(vm.gray_stack, sizeof(Obj*) * vm.gray_capacity);
+        if (vm.gray_stack == NULL) exit(1);
+    }
+
+    vm.gray_stack[vm.gray_count++] = object;
+}
+
+void mark_object(Obj* object) {
+    if (object == NULL) return;
+    if (object->is_marked) return;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*) object);
+    print_value(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    // Young objects are traced like any other but never swept;
+    // clear_young_marks() resets them once the collection is done.
+    object->is_marked = true;
+    push_gray(object);
+}
+
+void mark_value(Value val) {
+    if (IS_OBJ(val)) mark_object(AS_OBJ(val));
+}
+
+static void mark_array(ValueArray* arr) {
+    for (int i = 0; i < arr->count; i++) {
+        mark_value(arr->values[i]);
+    }
+}
+
+static void blacken_object(Obj* object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void*) object);
+    print_value(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    switch (object->type) {
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*) object;
+            mark_object((Obj*) function->name);
+            mark_array(&function->chunk.constants);
+            break;
+        }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*) object;
+            mark_object(rope->left);
+            mark_object(rope->right);
+            mark_object((Obj*) rope->flat);
+            break;
+        }
+        case OBJ_STRING:
+            break;
+    }
+}
+
 static void free_object(Obj* object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*) object, object->type);
+#endif
+
     switch (object->type) {
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*) object;
+#ifdef JIT
+            jit_free(function->jit);
+#endif
             free_chunk(&function->chunk);
             FREE(ObjFunction, object);
             break;
         }
+        case OBJ_ROPE:
+            FREE(ObjRope, object);
+            break;
         case OBJ_STRING: {
             ObjString* string = (ObjString*) object;
-            FREE_ARRAY(char, string->chars, string->length+1);
-            FREE(ObjString, object);
+            reallocate(object, string_size(string->length), 0);
             break;
         }
     }
 }
 
+static void mark_roots() {
+    for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
+        mark_value(*slot);
+    }
+
+    for (int i = 0; i < vm.frame_count; i++) {
+        mark_object((Obj*) vm.frames[i].function);
+    }
+
+    mark_table(&vm.global_names);
+    mark_array(&vm.global_values);
+    mark_compiler_roots();
+
+    if (vm.linking != NULL) {
+        for (Obj* object = vm.linking->objects; object != NULL; object = object->next) {
+            object->is_marked = false; // Left over from the last collection, which can't sweep them.
+            mark_object(object);
+        }
+    }
+}
+
+static void trace_references() {
+    while (vm.gray_count > 0) {
+        Obj* object = vm.gray_stack[--vm.gray_count];
+        blacken_object(object);
+    }
+}
+
+static void prune_remembered() {
+    int count = 0;
+    for (int i = 0; i < vm.remembered_count; i++) {
+        if (vm.remembered[i]->is_marked) vm.remembered[count++] = vm.remembered[i];
+    }
+    vm.remembered_count = count;
+}
+
+static size_t align_young(size_t size) {
+    return (size + 7) & ~(size_t) 7;
+}
+
+static size_t young_object_size(Obj* object) {
+    switch (object->type) {
+        case OBJ_ROPE: return align_young(sizeof(ObjRope));
+        case OBJ_STRING: return align_young(string_size(((ObjString*) object)->length));
+        default: return 0; // unreachable: functions are never young.
+    }
+}
+
+static void clear_young_marks() {
+    uint8_t* cursor = vm.nursery;
+    while (cursor < vm.nursery_top) {
+        Obj* object = (Obj*) cursor;
+        object->is_marked = false;
+        cursor += young_object_size(object);
+    }
+}
+
+static void sweep() {
+    Obj* previous = NULL;
+    Obj* object = vm.objects;
+
+    while (object != NULL) {
+        if (object->is_marked) {
+            object->is_marked = false;
+            previous = object;
+            object = object->next;
+            continue;
+        }
+
+        Obj* unreached = object;
+        object = object->next;
+        if (previous != NULL) {
+            previous->next = object;
+        } else {
+            vm.objects = object;
+        }
+
+        free_object(unreached);
+    }
+}
+
+void collect_garbage() {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+    size_t before = vm.bytes_allocated;
+#endif
+
+    mark_roots();
+    trace_references();
+    table_remove_white(&vm.strings); // Interned strings are weak references.
+    prune_remembered();
+    sweep();
+    clear_young_marks();
+
+    vm.next_GC = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+           before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_GC);
+#endif
+}
+
 void free_objects() {
     Obj* object = vm.objects;
     while (object != NULL) {
@@ -43,5 +243,152 @@ void free_objects() {
         free_object(object);
         object = next;
     }
+
+    free(vm.gray_stack);
+    free(vm.remembered);
+    free(vm.nursery);
+}
+
+void init_nursery() {
+    vm.nursery = (uint8_t*) malloc(NURSERY_SIZE);
+    if (vm.nursery == NULL) exit(1);
+
+    vm.nursery_top = vm.nursery;
+    vm.nursery_end = vm.nursery + NURSERY_SIZE;
+    vm.collecting_nursery = false;
+
+    vm.remembered_count = 0;
+    vm.remembered_capacity = 0;
+    vm.remembered = NULL;
+}
+
+void* allocate_young(size_t size) {
+    size = align_young(size);
+    if (size > NURSERY_MAX_OBJECT) return NULL;
+
+#ifdef DEBUG_STRESS_GC
+    collect_nursery();
+#endif
+
+    if (vm.nursery_top + size > vm.nursery_end) collect_nursery();
+
+    void* result = vm.nursery_top;
+    vm.nursery_top += size;
+    return result;
+}
+
+void free_young(void* pointer, size_t size) {
+    // Only the most recent allocation can be handed back; anything else waits for the next minor collection.
+    if ((uint8_t*) pointer + align_young(size) == vm.nursery_top) vm.nursery_top = (uint8_t*) pointer;
+}
+
+bool is_young(Obj* object) {
+    return (uint8_t*) object >= vm.nursery && (uint8_t*) object < vm.nursery_end;
+}
+
+Obj* forwarding_address(Obj* object) {
+    return object->next;
+}
+
+void write_barrier(Obj* owner, Value val) {
+    if (!IS_OBJ(val) || !is_young(AS_OBJ(val))) return;
+    if (owner->is_remembered || is_young(owner)) return;
+
+    if (vm.remembered_capacity < vm.remembered_count+1) {
+        vm.remembered_capacity = GROW_CAPACITY(vm.remembered_capacity);
+        vm.remembered = (Obj**) realloc(vm.remembered, sizeof(Obj*) * vm.remembered_capacity);
+        if (vm.remembered == NULL) exit(1);
+    }
+
+    owner->is_remembered = true;
+    vm.remembered[vm.remembered_count++] = owner;
+}
+
+static Obj* promote(Obj* object) {
+    Obj* forwarded = forwarding_address(object);
+    if (forwarded != NULL) return forwarded;
+
+    switch (object->type) {
+        case OBJ_ROPE:
+            forwarded = (Obj*) promote_rope((ObjRope*) object);
+            push_gray(forwarded); // Its children may still be young.
+            break;
+        case OBJ_STRING:
+            forwarded = (Obj*) promote_string((ObjString*) object);
+            break;
+        default:
+            return object; // unreachable: functions are never young.
+    }
+
+    object->next = forwarded;
+    return forwarded;
+}
+
+void promote_object(Obj** slot) {
+    if (*slot != NULL && is_young(*slot)) *slot = promote(*slot);
+}
+
+void promote_value(Value* slot) {
+    if (IS_OBJ(*slot) && is_young(AS_OBJ(*slot))) *slot = OBJ_VAL(promote(AS_OBJ(*slot)));
 }
 
+static void promote_references(Obj* object) {
+    switch (object->type) {
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*) object;
+            promote_object((Obj**) &function->name);
+            for (int i = 0; i < function->chunk.constants.count; i++) {
+                promote_value(&function->chunk.constants.values[i]);
+            }
+            break;
+        }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*) object;
+            promote_object(&rope->left);
+            promote_object(&rope->right);
+            promote_object((Obj**) &rope->flat);
+            break;
+        }
+        case OBJ_STRING:
+            break;
+    }
+}
+
+void collect_nursery() {
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm.bytes_allocated;
+#endif
+
+    vm.collecting_nursery = true;
+
+    for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
+        promote_value(slot);
+    }
+
+    promote_table(&vm.global_names);
+    for (int i = 0; i < vm.global_values.count; i++) {
+        promote_value(&vm.global_values.values[i]);
+    }
+
+    for (int i = 0; i < vm.remembered_count; i++) {
+        promote_references(vm.remembered[i]);
+        vm.remembered[i]->is_remembered = false;
+    }
+    vm.remembered_count = 0;
+
+    // Promoted ropes were pushed onto the gray stack; scanning them may promote more.
+    while (vm.gray_count > 0) {
+        promote_references(vm.gray_stack[--vm.gray_count]);
+    }
+
+    table_remove_young(&vm.strings); // Weak, like in a full collection.
+    vm.nursery_top = vm.nursery;
+
+    vm.collecting_nursery = false;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   promoted %zu bytes\n", vm.bytes_allocated - before);
+#endif
+}
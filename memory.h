@@ -23,7 +23,23 @@
 #define FREE_ARRAY(type, pointer, old_count) \
     reallocate(pointer, sizeof(type) * (old_count), 0)
 
+#define NURSERY_SIZE (256 * 1024)
+#define NURSERY_MAX_OBJECT (NURSERY_SIZE / 16)
+
 void* reallocate(void* pointer, size_t old_size, size_t new_size);
+void mark_object(Obj* object);
+void mark_value(Value val);
+void collect_garbage();
 void free_objects();
 
+void init_nursery();
+void* allocate_young(size_t size);
+void free_young(void* pointer, size_t size);
+bool is_young(Obj* object);
+Obj* forwarding_address(Obj* object);
+void write_barrier(Obj* owner, Value val);
+void promote_object(Obj** slot);
+void promote_value(Value* slot);
+void collect_nursery();
+
 #endif //FAVE_CUH_MEMORY_H
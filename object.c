@@ -3,6 +3,7 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -18,8 +19,16 @@
 static Obj* allocate_object(size_t size, ObjType type) {
     Obj* object = (Obj*) reallocate(NULL, 0, size);
     object->type = type;
-    object->next = vm.objects;
-    vm.objects = object;
+    object->is_marked = false;
+    object->is_remembered = false;
+
+    Obj** objects = thread_heap != NULL ? &thread_heap->objects : &vm.objects;
+    object->next = *objects;
+    *objects = object;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p allocate %zu for %d\n", (void*) object, size, type);
+#endif
 
     return object;
 }
@@ -28,20 +37,50 @@ ObjFunction* new_function() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->name = NULL;
+    function->hotness = 0;
+    function->jit = NULL;
     init_chunk(&function->chunk);
     return function;
 }
 
-static ObjString* allocate_string(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+static Obj* allocate_young_object(size_t size, ObjType type) {
+    if (thread_heap != NULL) return NULL; // The nursery belongs to the VM's thread.
+
+    Obj* object = (Obj*) allocate_young(size);
+    if (object == NULL) return NULL;
+
+    object->type = type;
+    object->is_marked = false;
+    object->is_remembered = false;
+    object->next = NULL; // Becomes the forwarding address once promoted.
+    return object;
+}
+
+ObjRope* new_rope(int length) {
+    ObjRope* rope = (ObjRope*) allocate_young_object(sizeof(ObjRope), OBJ_ROPE);
+    if (rope == NULL) rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+
+    rope->length = length;
+    rope->left = NULL;
+    rope->right = NULL;
+    rope->flat = NULL;
+    return rope;
+}
+
+ObjString* make_string(int length) {
+    size_t size = string_size(length);
+    ObjString* string = (ObjString*) allocate_young_object(size, OBJ_STRING);
+
+    // Too large for the nursery, so it goes straight to the main heap.
+    if (string == NULL) string = (ObjString*) allocate_object(size, OBJ_STRING);
+
     string->length = length;
-    string->chars = chars;
-    string->hash = hash;
-    table_set(&vm.strings, string, NIL_VAL);
+    string->chars[length] = '\0';
+    string->hash = 0;
     return string;
 }
 
-static uint32_t hash_string(const char* key, int length) {
+uint32_t hash_string(const char* key, int length) {
     uint32_t hash = 2166136261u;
     for (int i = 0; i < length; i++) {
         hash ^= (uint8_t) key[i];
@@ -50,28 +89,143 @@ static uint32_t hash_string(const char* key, int length) {
     return hash;
 }
 
-ObjString* take_string(const char* chars, int length) {
-    uint32_t hash = hash_string(chars, length);
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
+static Table* interned_strings() {
+    return thread_heap != NULL ? &thread_heap->strings : &vm.strings;
+}
+
+static ObjString* register_string(ObjString* string) {
+    if (thread_heap != NULL) {
+        table_set(&thread_heap->strings, string, NIL_VAL);
+        return string;
+    }
+
+    push(OBJ_VAL(string));
+    table_set(&vm.strings, string, NIL_VAL);
+    pop();
+
+    return string;
+}
+
+ObjString* intern_string(ObjString* string) {
+    uint32_t hash = hash_string(string->chars, string->length);
+    ObjString* interned = table_find_string(interned_strings(), string->chars, string->length, hash);
 
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length+1);
+        if (is_young((Obj*) string)) free_young(string, string_size(string->length));
         return interned;
     }
 
-    return allocate_string(chars, length, hash);
+    string->hash = hash;
+    return register_string(string);
 }
 
 ObjString* copy_string(const char* chars, int length) {
-    uint32_t hash = hash_string(chars, length);
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
+    return copy_string_with_hash(chars, length, hash_string(chars, length));
+}
+
+// The hash must be hash_string(chars, length); the scanner computes it for identifiers.
+ObjString* copy_string_with_hash(const char* chars, int length, uint32_t hash) {
+    ObjString* interned = table_find_string(interned_strings(), chars, length, hash);
 
     if (interned != NULL) return interned;
 
-    char* heap_chars = ALLOCATE(char, length + 1);
-    memcpy(heap_chars, chars, length);
-    heap_chars[length] = '\0';
-    return allocate_string(heap_chars, length, hash);
+    ObjString* string = make_string(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    return register_string(string);
+}
+
+static bool is_rope_leaf(Obj* node) {
+    return node->type == OBJ_STRING || ((ObjRope*) node)->flat != NULL;
+}
+
+static ObjString* rope_leaf(Obj* node) {
+    return node->type == OBJ_STRING ? (ObjString*) node : ((ObjRope*) node)->flat;
+}
+
+// Fills dest from the right so the left-leaning chains built by `s = s + x`
+// only ever keep a couple of nodes on the work stack.
+static void copy_rope_chars(ObjRope* rope, char* dest) {
+    char* end = dest + rope->length;
+
+    int count = 0;
+    int capacity = 8;
+    Obj** stack = (Obj**) malloc(sizeof(Obj*) * capacity);
+    if (stack == NULL) exit(1);
+    stack[count++] = (Obj*) rope;
+
+    while (count > 0) {
+        Obj* node = stack[--count];
+
+        if (is_rope_leaf(node)) {
+            ObjString* leaf = rope_leaf(node);
+            end -= leaf->length;
+            memcpy(end, leaf->chars, leaf->length);
+            continue;
+        }
+
+        if (capacity < count+2) {
+            capacity = GROW_CAPACITY(capacity);
+            stack = (Obj**) realloc(stack, sizeof(Obj*) * capacity);
+            if (stack == NULL) exit(1);
+        }
+
+        ObjRope* branch = (ObjRope*) node;
+        stack[count++] = branch->left;
+        stack[count++] = branch->right;
+    }
+
+    free(stack);
+}
+
+ObjString* flatten_rope(ObjRope* rope) {
+    if (rope->flat != NULL) return rope->flat;
+
+    // The result bypasses the nursery so that nothing moves while the
+    // children are copied; the caller keeps the rope reachable.
+    ObjString* string = (ObjString*) allocate_object(string_size(rope->length), OBJ_STRING);
+    string->length = rope->length;
+    string->chars[rope->length] = '\0';
+    copy_rope_chars(rope, string->chars);
+
+    string = intern_string(string);
+    rope->flat = string;
+    write_barrier((Obj*) rope, OBJ_VAL(string));
+    rope->left = NULL;
+    rope->right = NULL;
+    return string;
+}
+
+ObjString* promote_string(ObjString* young) {
+    ObjString* string = (ObjString*) allocate_object(string_size(young->length), OBJ_STRING);
+    string->length = young->length;
+    string->hash = young->hash;
+    memcpy(string->chars, young->chars, young->length+1);
+    return string;
+}
+
+ObjRope* promote_rope(ObjRope* young) {
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = young->length;
+    rope->left = young->left;
+    rope->right = young->right;
+    rope->flat = young->flat;
+    return rope;
+}
+
+static void print_rope(ObjRope* rope) {
+    if (rope->flat != NULL) {
+        printf("%s", rope->flat->chars);
+        return;
+    }
+
+    // Printing must not allocate on the heap, so copy into a scratch buffer instead of flattening.
+    char* chars = (char*) malloc(rope->length+1);
+    if (chars == NULL) exit(1);
+    copy_rope_chars(rope, chars);
+    chars[rope->length] = '\0';
+    printf("%s", chars);
+    free(chars);
 }
 
 static void print_function(ObjFunction* function) {
@@ -80,13 +234,17 @@ static void print_function(ObjFunction* function) {
         return;
     }
 
-    printf("<fn %s", function->name->chars);
+    printf("<fn %s>", function->name->chars);
 }
 
 void print_object(Value val) {
     switch (OBJ_TYPE(val)) {
         case OBJ_FUNCTION:
             print_function(AS_FUNCTION(val));
+            break;
+        case OBJ_ROPE:
+            print_rope(AS_ROPE(val));
+            break;
         case OBJ_STRING:
             printf("%s", AS_CSTRING(val));
             break;
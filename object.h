@@ -11,20 +11,25 @@
 
 #define OBJ_TYPE(val)       (AS_OBJ(val)->type)
 
-#define IS_FUNCTION(val)    is_obj_type(val, OBJ_FUNCTION);
+#define IS_FUNCTION(val)    is_obj_type(val, OBJ_FUNCTION)
+#define IS_ROPE(val)        is_obj_type(val, OBJ_ROPE)
 #define IS_STRING(val)      is_obj_type(val, OBJ_STRING)
 
 #define AS_FUNCTION(val)    ((ObjFunction*)AS_OBJ(val))
+#define AS_ROPE(val)        ((ObjRope*)AS_OBJ(val))
 #define AS_STRING(val)      ((ObjString*)AS_OBJ(val))
 #define AS_CSTRING(val)     (((ObjString*)AS_OBJ(val))->chars)
 
 typedef enum {
     OBJ_FUNCTION,
+    OBJ_ROPE,
     OBJ_STRING,
 } ObjType;
 
 struct Obj {
     ObjType type;
+    bool is_marked;
+    bool is_remembered;
     struct Obj* next;
 };
 
@@ -33,22 +38,54 @@ typedef struct {
     int arity;
     Chunk chunk;
     ObjString* name;
+    int hotness; // Loop back-edges taken, until the JIT picks the function up.
+    struct JitCode* jit;
 } ObjFunction;
 
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
     uint32_t hash;
+    char chars[]; // Stored inline, NUL-terminated.
 };
 
+// A lazy concatenation of two strings or ropes. The characters are only
+// copied, hashed and interned when flatten_rope() is called, after which
+// the children are dropped and the result is cached in flat.
+typedef struct {
+    Obj obj;
+    int length;
+    Obj* left;
+    Obj* right;
+    ObjString* flat;
+} ObjRope;
+
 ObjFunction* new_function();
-ObjString* take_string(const char* chars, int length);
+ObjRope* new_rope(int length);
+ObjString* make_string(int length);
+ObjString* intern_string(ObjString* string);
 ObjString* copy_string(const char* chars, int length);
+ObjString* copy_string_with_hash(const char* chars, int length, uint32_t hash);
+uint32_t hash_string(const char* key, int length);
+ObjString* flatten_rope(ObjRope* rope);
+ObjString* promote_string(ObjString* young);
+ObjRope* promote_rope(ObjRope* young);
 void print_object(Value val);
 
 static inline bool is_obj_type(Value val, ObjType type) {
     return IS_OBJ(val) && AS_OBJ(val)->type == type;
 }
 
+static inline size_t string_size(int length) {
+    return sizeof(ObjString) + length + 1;
+}
+
+static inline bool is_text(Value val) {
+    return IS_STRING(val) || IS_ROPE(val);
+}
+
+static inline int text_length(Value val) {
+    return IS_STRING(val) ? AS_STRING(val)->length : AS_ROPE(val)->length;
+}
+
 #endif //FAVE_CUH_OBJECT_H
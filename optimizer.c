@@ -0,0 +1,204 @@
+//
+// Created by Fabian Simon on 17.10.26.
+//
+
+#include "optimizer.h"
+#include "memory.h"
+
+// Bounds how many jumps are followed when threading, so a jump cycle can't hang the compiler.
+#define MAX_THREAD_HOPS 16
+
+int instruction_length(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+            return 2;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_ADD_LOCAL_LOCAL:
+        case OP_INCREMENT_LOCAL:
+        case OP_INCREMENT_LOCAL_POP:
+        case OP_DECREMENT_LOCAL:
+        case OP_DECREMENT_LOCAL_POP:
+            return 3;
+        case OP_ADD_REG_REG:
+        case OP_ADD_REG_CONST:
+        case OP_SUBTRACT_REG_REG:
+        case OP_SUBTRACT_REG_CONST:
+        case OP_MULTIPLY_REG_REG:
+        case OP_MULTIPLY_REG_CONST:
+        case OP_DIVIDE_REG_REG:
+        case OP_DIVIDE_REG_CONST:
+            return 4;
+        case OP_JUMP_UNLESS_LESS_LOCAL:
+        case OP_JUMP_UNLESS_GREATER_LOCAL:
+        case OP_JUMP_IF_LESS_LOCAL:
+        case OP_JUMP_IF_GREATER_LOCAL:
+            return 5;
+        default:
+            return 1;
+    }
+}
+
+static bool is_unconditional_jump(uint8_t instruction) {
+    return instruction == OP_JUMP || instruction == OP_LOOP;
+}
+
+bool is_jump(uint8_t instruction) {
+    switch (instruction) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_JUMP_UNLESS_LESS_LOCAL:
+        case OP_JUMP_UNLESS_GREATER_LOCAL:
+        case OP_JUMP_IF_LESS_LOCAL:
+        case OP_JUMP_IF_GREATER_LOCAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Every jump keeps its 16-bit offset in its last two bytes, relative to the next instruction.
+int jump_target(Chunk* chunk, int offset) {
+    int end = offset + instruction_length(chunk->code[offset]);
+    int jump = (chunk->code[end-2] << 8) | chunk->code[end-1];
+    return chunk->code[offset] == OP_LOOP ? end - jump : end + jump;
+}
+
+// Writes a jump from offset to target, switching between OP_JUMP and OP_LOOP
+// for unconditional jumps. Returns false if the jump can't be encoded.
+static bool set_jump_target(Chunk* chunk, int offset, int target) {
+    uint8_t instruction = chunk->code[offset];
+    int end = offset + instruction_length(instruction);
+    int jump = target - end;
+
+    if (is_unconditional_jump(instruction)) instruction = jump < 0 ? OP_LOOP : OP_JUMP;
+    else if (jump < 0) return false;
+    if (jump < 0) jump = -jump;
+    if (jump > UINT16_MAX) return false;
+
+    chunk->code[offset] = instruction;
+    chunk->code[end-2] = (jump >> 8) & 0xff;
+    chunk->code[end-1] = jump & 0xff;
+    return true;
+}
+
+// Retargets jumps that land on an unconditional jump to that jump's destination.
+// A conditional jump may also skip past another conditional jump, since the
+// tested value stays on the stack and is still falsey when it arrives there.
+static void thread_jumps(Chunk* chunk) {
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk->code[offset])) {
+        uint8_t instruction = chunk->code[offset];
+        if (!is_jump(instruction)) continue;
+
+        int target = jump_target(chunk, offset);
+        for (int hops = 0; hops < MAX_THREAD_HOPS && target < chunk->count; hops++) {
+            uint8_t next = chunk->code[target];
+            bool follows = is_unconditional_jump(next) ||
+                           (next == OP_JUMP_IF_FALSE && instruction == OP_JUMP_IF_FALSE);
+            if (!follows) break;
+
+            target = jump_target(chunk, target);
+            if (!set_jump_target(chunk, offset, target)) break;
+        }
+    }
+}
+
+// Instructions that only push a value, with no other effect or failure mode.
+static bool is_pure_push(uint8_t instruction) {
+    return instruction == OP_CONSTANT || instruction == OP_NIL ||
+           instruction == OP_TRUE || instruction == OP_FALSE ||
+           instruction == OP_GET_LOCAL;
+}
+
+// Returns the opcode that replaces the pair, OP_POP if the pair can be
+// dropped altogether, or -1 if it doesn't match any pattern.
+static int fuse_pair(uint8_t first, uint8_t second) {
+    if (second == OP_NOT) {
+        switch (first) {
+            case OP_EQUAL:      return OP_NOT_EQUAL;
+            case OP_LESS:       return OP_GREATER_EQUAL;
+            case OP_GREATER:    return OP_LESS_EQUAL;
+            default:            return -1;
+        }
+    }
+
+    if (second == OP_POP) {
+        if (first == OP_SET_LOCAL) return OP_SET_LOCAL_POP;
+        if (first == OP_INCREMENT_LOCAL) return OP_INCREMENT_LOCAL_POP;
+        if (first == OP_DECREMENT_LOCAL) return OP_DECREMENT_LOCAL_POP;
+        if (is_pure_push(first)) return OP_POP;
+    }
+
+    return -1;
+}
+
+void optimize_chunk(Chunk* chunk) {
+    int count = chunk->count;
+    if (count == 0) return;
+
+    thread_jumps(chunk);
+
+    bool* is_target = ALLOCATE(bool, count+1);
+    int* new_offset = ALLOCATE(int, count+1);
+    int* old_target = ALLOCATE(int, count);
+
+    for (int offset = 0; offset <= count; offset++) is_target[offset] = false;
+    for (int offset = 0; offset < count; offset += instruction_length(chunk->code[offset])) {
+        if (is_jump(chunk->code[offset])) is_target[jump_target(chunk, offset)] = true;
+    }
+
+    // Compact in place. The write position never overtakes the read position,
+    // so every instruction is read before it can be overwritten.
+    int write = 0;
+    for (int read = 0; read < count;) {
+        uint8_t instruction = chunk->code[read];
+        int length = instruction_length(instruction);
+        int next = read + length;
+        new_offset[read] = write;
+
+        if (next < count && !is_target[next]) {
+            int fused = fuse_pair(instruction, chunk->code[next]);
+            if (fused >= 0) {
+                // The fused instruction keeps the operands of the first one.
+                new_offset[next] = write;
+                if (fused != OP_POP) {
+                    chunk->code[read] = (uint8_t) fused;
+                    for (int i = 0; i < length; i++) {
+                        chunk->code[write+i] = chunk->code[read+i];
+                        chunk->lines[write+i] = chunk->lines[read];
+                    }
+                    write += length;
+                }
+
+                read = next + instruction_length(chunk->code[next]);
+                continue;
+            }
+        }
+
+        if (is_jump(instruction)) old_target[write] = jump_target(chunk, read);
+        for (int i = 0; i < length; i++) {
+            chunk->code[write+i] = chunk->code[read+i];
+            chunk->lines[write+i] = chunk->lines[read+i];
+        }
+        write += length;
+        read = next;
+    }
+    new_offset[count] = write;
+    chunk->count = write;
+
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk->code[offset])) {
+        if (is_jump(chunk->code[offset])) set_jump_target(chunk, offset, new_offset[old_target[offset]]);
+    }
+
+    FREE_ARRAY(int, old_target, count);
+    FREE_ARRAY(int, new_offset, count+1);
+    FREE_ARRAY(bool, is_target, count+1);
+}
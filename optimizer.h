@@ -0,0 +1,15 @@
+//
+// Created by Fabian Simon on 17.10.26.
+//
+
+#ifndef FAVE_CUH_OPTIMIZER_H
+#define FAVE_CUH_OPTIMIZER_H
+
+#include "chunk.h"
+
+int instruction_length(uint8_t instruction);
+bool is_jump(uint8_t instruction);
+int jump_target(Chunk* chunk, int offset);
+void optimize_chunk(Chunk* chunk);
+
+#endif //FAVE_CUH_OPTIMIZER_H
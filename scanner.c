@@ -3,9 +3,15 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "scanner.h"
+#include "object.h"
 #include "common.h"
 
 typedef struct {
@@ -14,12 +20,72 @@ typedef struct {
     int line;
 } Scanner;
 
-Scanner scanner;
+_Thread_local Scanner scanner;
+
+#define STREAM_CHUNK 65536
+#define STREAM_TAIL 16     // Zeroed bytes past limit, for find_stop's 16-byte loads.
+#define STREAM_LOOKAHEAD 2 // A token decision peeks at most at curr[1].
+#define TOKEN_RING 4       // The parser holds two tokens; the rest is slack.
+
+typedef struct {
+    char* chars;
+    int length;
+    uint32_t hash;
+} Name;
+
+// Streamed input lives in a window that is refilled from read, so tokens
+// are moved out of it before they are handed to the parser: identifiers
+// are interned in names, whose text lives until free_scanner() because
+// locals keep pointing at it, and everything else is copied into a ring
+// of buffers that only has to outlast the parser's lookahead.
+typedef struct {
+    ScannerReader read; // NULL when the whole source is in memory.
+    void* context;
+    char* window;
+    size_t capacity;
+    const char* limit;  // One past the last byte read; always a NUL.
+    bool eof;
+
+    Name* names;
+    int name_count;
+    int name_capacity;
+
+    char* ring[TOKEN_RING];
+    int ring_capacity[TOKEN_RING];
+    int ring_next;
+} Stream;
+
+static _Thread_local Stream stream;
 
 void init_scanner(const char* src) {
     scanner.start = src;
     scanner.curr = src;
     scanner.line = 1;
+    stream.read = NULL;
+}
+
+void init_scanner_stream(ScannerReader read, void* context) {
+    stream = (Stream) {0};
+    stream.read = read;
+    stream.context = context;
+    stream.capacity = STREAM_CHUNK;
+    // malloc's 16-byte alignment keeps find_stop's aligned loads inside the block.
+    stream.window = malloc(stream.capacity + STREAM_TAIL);
+    if (stream.window == NULL) exit(1);
+    memset(stream.window, 0, STREAM_TAIL);
+    stream.limit = stream.window;
+
+    scanner.start = stream.window;
+    scanner.curr = stream.window;
+    scanner.line = 1;
+}
+
+void free_scanner() {
+    free(stream.window);
+    for (int i = 0; i < stream.name_capacity; i++) free(stream.names[i].chars);
+    free(stream.names);
+    for (int i = 0; i < TOKEN_RING; i++) free(stream.ring[i]);
+    stream = (Stream) {0};
 }
 
 static bool is_end() {
@@ -53,6 +119,7 @@ static Token generate_token(TokenType type) {
     token.start = scanner.start;
     token.length = (int)(scanner.curr - scanner.start);
     token.line = scanner.line;
+    token.hash = 0;
     return token;
 }
 
@@ -61,95 +128,205 @@ static Token error_token(const char* message) {
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int) strlen(message);
-    token.length = scanner.line;
+    token.line = scanner.line;
+    token.hash = 0;
     return token;
 }
 
+#ifdef __SSE2__
+
+// Each class below returns a bit per byte of a 16-byte block for the bytes
+// that end a run of that class. NUL always ends a run.
+typedef uint32_t (*StopMask)(__m128i bytes);
+
+static inline uint32_t byte_mask(__m128i bytes, char c) {
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)));
+}
+
+// Signed compares are fine: every byte with the sign bit set is out of range anyway.
+static inline uint32_t range_mask(__m128i bytes, char low, char high) {
+    __m128i too_low = _mm_cmplt_epi8(bytes, _mm_set1_epi8(low));
+    __m128i too_high = _mm_cmpgt_epi8(bytes, _mm_set1_epi8(high));
+    return (uint32_t) _mm_movemask_epi8(_mm_or_si128(too_low, too_high)) ^ 0xffff;
+}
+
+static inline uint32_t whitespace_stops(__m128i bytes) {
+    return (byte_mask(bytes, ' ') | byte_mask(bytes, '\t') |
+            byte_mask(bytes, '\r') | byte_mask(bytes, '\n')) ^ 0xffff;
+}
+
+static inline uint32_t comment_stops(__m128i bytes) {
+    return byte_mask(bytes, '\n') | byte_mask(bytes, '\0');
+}
+
+static inline uint32_t string_stops(__m128i bytes) {
+    return byte_mask(bytes, '"') | byte_mask(bytes, '\0');
+}
+
+static inline uint32_t digit_stops(__m128i bytes) {
+    return range_mask(bytes, '0', '9') ^ 0xffff;
+}
+
+static inline uint32_t identifier_stops(__m128i bytes) {
+    __m128i lower = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+    return (range_mask(lower, 'a', 'z') | range_mask(bytes, '0', '9') | byte_mask(bytes, '_')) ^ 0xffff;
+}
+
+// Returns the first byte at or after p that ends a run, adding the newlines
+// passed on the way to *lines if it isn't NULL. Loads are aligned, so a block
+// never crosses into the next page and reading past the NUL sentinel is safe
+// even at the very end of a mapped file. That does read outside the buffer,
+// which is what address sanitizer would flag.
+__attribute__((no_sanitize_address))
+static inline const char* find_stop(const char* p, StopMask stop_mask, int* lines) {
+    int misalignment = (int) ((uintptr_t) p & 15);
+    const char* block = p - misalignment;
+    uint32_t ignored = (1u << misalignment) - 1;
+
+    for (;;) {
+        __m128i bytes = _mm_load_si128((const __m128i*) block);
+        uint32_t stops = stop_mask(bytes) & ~ignored;
+        uint32_t newlines = lines != NULL ? byte_mask(bytes, '\n') & ~ignored : 0;
+
+        if (stops != 0) {
+            int index = __builtin_ctz(stops);
+            if (lines != NULL) *lines += __builtin_popcount(newlines & ((1u << index) - 1));
+            return block + index;
+        }
+
+        if (lines != NULL) *lines += __builtin_popcount(newlines);
+        block += 16;
+        ignored = 0;
+    }
+}
+
+#endif
+
+static bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static bool is_alpha(char c) {
+    return (c >= 'a' && c <= 'z') ||
+           (c >= 'A' && c <= 'Z') ||
+           c == '_';
+}
+
+static void skip_whitespace_run() {
+#ifdef __SSE2__
+    scanner.curr = find_stop(scanner.curr, whitespace_stops, &scanner.line);
+#else
+    for (;;) {
+        switch (peek()) {
+            case '\n':
+                scanner.line++;
+            case ' ':
+            case '\r':
+            case '\t':
+                advance();
+                break;
+            default:
+                return;
+        }
+    }
+#endif
+}
+
+static void skip_comment() {
+#ifdef __SSE2__
+    scanner.curr = find_stop(scanner.curr, comment_stops, NULL);
+#else
+    while (peek() != '\n' && !is_end()) advance();
+#endif
+}
+
+// Leaves scanner.start at a comment that ran into the end of the input,
+// which a stream has to scan again once it has read the rest of it.
 static void skip_wspace() {
     for (;;) {
+        scanner.start = scanner.curr;
         char c = peek();
         switch (c) {
             case ' ':
             case '\r':
             case '\t':
-                advance();
-                break;
             case '\n':
-                scanner.line++;
-                advance();
+                skip_whitespace_run();
                 break;
             case '/':
                 if (peek_next() == '/') {
-                    while (peek() != '\n' && !is_end()) advance();
-                } else {
-                    return;
+                    skip_comment();
+                    if (is_end()) return;
+                    break;
                 }
+                return;
             default:
                 return;
         }
     }
 }
 
-static TokenType check_keyword(int start, int length, const char* rest, TokenType type) {
-    if ((scanner.curr - scanner.start == start + length) &&
-            (memcmp(scanner.start + start, rest, length) == 0)) {
-        return type;
-    }
-    return TOKEN_IDENTIFIER;
+typedef struct {
+    const char* name;
+    int length;
+    TokenType type;
+} Keyword;
+
+// Perfect hash over the keywords: no two share a slot, so a single compare
+// decides whether an identifier is a keyword. Each entry sits at
+// keyword_slot() of its name; recompute the slots when adding a keyword.
+#define KEYWORD_SLOTS 32
+
+static const Keyword keywords[KEYWORD_SLOTS] = {
+    [2]  = {"else", 4, TOKEN_ELSE},
+    [3]  = {"for", 3, TOKEN_FOR},
+    [4]  = {"false", 5, TOKEN_FALSE},
+    [7]  = {"class", 5, TOKEN_CLASS},
+    [9]  = {"if", 2, TOKEN_IF},
+    [11] = {"or", 2, TOKEN_OR},
+    [13] = {"nil", 3, TOKEN_NIL},
+    [15] = {"fun", 3, TOKEN_FUN},
+    [17] = {"true", 4, TOKEN_TRUE},
+    [18] = {"super", 5, TOKEN_SUPER},
+    [19] = {"var", 3, TOKEN_VAR},
+    [21] = {"while", 5, TOKEN_WHILE},
+    [23] = {"this", 4, TOKEN_THIS},
+    [24] = {"and", 3, TOKEN_AND},
+    [25] = {"print", 5, TOKEN_PRINT},
+    [30] = {"return", 6, TOKEN_RETURN},
+};
+
+static int keyword_slot(const char* start, int length) {
+    return ((uint8_t) start[0] + 5 * (uint8_t) start[length-1] + length) & (KEYWORD_SLOTS-1);
 }
 
-// d
-
 static TokenType get_identifier_type() {
-    switch (scanner.start[0]) {
-        case 'a': return check_keyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return check_keyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return check_keyword(1, 3, "lse", TOKEN_ELSE);
-        case 'f':
-            if (scanner.curr - scanner.start > 1)
-            {
-                switch (scanner.start[1]) {
-                    case 'a': return check_keyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return check_keyword(2, 1, "r", TOKEN_FOR);
-                    case 'u': return check_keyword(2, 1, "n", TOKEN_FOR);
-                }
-            }
-        case 'i': return check_keyword(1, 1, "f", TOKEN_IF);
-        case 'n': return check_keyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return check_keyword(1, 1, "r", TOKEN_OR);
-        case 'p': return check_keyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return check_keyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return check_keyword(1, 4, "uper", TOKEN_SUPER);
-        case 't':
-            if (scanner.curr - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'h': return check_keyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return check_keyword(2, 2, "ue", TOKEN_TRUE);
-                }
-            }
-        case 'v': return check_keyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return check_keyword(1, 4, "hile", TOKEN_WHILE);
-    }
-
+    int length = (int) (scanner.curr - scanner.start);
+    const Keyword* keyword = &keywords[keyword_slot(scanner.start, length)];
 
+    if (keyword->length == length && memcmp(scanner.start, keyword->name, length) == 0) {
+        return keyword->type;
+    }
     return TOKEN_IDENTIFIER;
 }
 
-static bool is_digit(char c) {
-    return c >= '0' && c <= '9';
-}
-
-static bool is_alpha(char c) {
-    return (c >= 'a' && c <= 'z') ||
-           (c >= 'A' && c <= 'Z') ||
-           c == '_';
+static void skip_digits() {
+#ifdef __SSE2__
+    scanner.curr = find_stop(scanner.curr, digit_stops, NULL);
+#else
+    while (is_digit(peek())) advance();
+#endif
 }
 
 static Token handle_string() {
+#ifdef __SSE2__
+    scanner.curr = find_stop(scanner.curr, string_stops, &scanner.line);
+#else
     while (peek() != '"' && !is_end()) {
         if (peek() == '\n') scanner.line++;
         advance();
     }
+#endif
 
     if (is_end()) return error_token("Unterminated string.");
 
@@ -158,22 +335,28 @@ static Token handle_string() {
 }
 
 static Token handle_number() {
-    while (is_digit(peek())) advance();
+    skip_digits();
 
     if (peek()=='.' && is_digit(peek_next())) {
         advance();
-        while (is_digit(peek())) advance();
+        skip_digits();
     }
 
     return generate_token(TOKEN_NUMBER);
 }
 
 static Token handle_identifier() {
+#ifdef __SSE2__
+    scanner.curr = find_stop(scanner.curr, identifier_stops, NULL);
+#else
     while (is_alpha(peek()) || is_digit(peek())) advance();
-    return generate_token(get_identifier_type());
+#endif
+    Token token = generate_token(get_identifier_type());
+    if (token.type == TOKEN_IDENTIFIER) token.hash = hash_string(token.start, token.length);
+    return token;
 }
 
-Token scan_token() {
+static Token scan_source_token() {
     skip_wspace();
 
     scanner.start = scanner.curr;
@@ -210,3 +393,112 @@ Token scan_token() {
 }
 
 
+
+// Slides the input from keep onwards to the front of the window and reads
+// more behind it. The window only grows when keep leaves little room, that
+// is when a single token is nearly as long as the window.
+static void refill(const char* keep) {
+    size_t kept = (size_t) (stream.limit - keep);
+    memmove(stream.window, keep, kept);
+
+    if (stream.capacity - kept < STREAM_CHUNK / 2) {
+        stream.capacity *= 2;
+        stream.window = realloc(stream.window, stream.capacity + STREAM_TAIL);
+        if (stream.window == NULL) exit(1);
+    }
+
+    size_t count = stream.read(stream.context, stream.window + kept, stream.capacity - kept);
+    if (count == 0) stream.eof = true;
+
+    stream.limit = stream.window + kept + count;
+    memset(stream.window + kept + count, 0, STREAM_TAIL);
+    scanner.curr = stream.window;
+}
+
+static void grow_names() {
+    int old_capacity = stream.name_capacity;
+    Name* old_names = stream.names;
+
+    stream.name_capacity = old_capacity < 64 ? 64 : old_capacity * 2;
+    stream.names = calloc(stream.name_capacity, sizeof(Name));
+    if (stream.names == NULL) exit(1);
+
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_names[i].chars == NULL) continue;
+        uint32_t index = old_names[i].hash & (stream.name_capacity-1);
+        while (stream.names[index].chars != NULL) index = (index+1) & (stream.name_capacity-1);
+        stream.names[index] = old_names[i];
+    }
+    free(old_names);
+}
+
+static const char* intern_name(const char* start, int length, uint32_t hash) {
+    if (stream.name_count + 1 > stream.name_capacity * 3 / 4) grow_names();
+
+    uint32_t index = hash & (stream.name_capacity-1);
+    for (;;) {
+        Name* name = &stream.names[index];
+        if (name->chars == NULL) {
+            name->chars = malloc(length);
+            if (name->chars == NULL) exit(1);
+            memcpy(name->chars, start, length);
+            name->length = length;
+            name->hash = hash;
+            stream.name_count++;
+            return name->chars;
+        }
+        if (name->hash == hash && name->length == length && memcmp(name->chars, start, length) == 0) {
+            return name->chars;
+        }
+        index = (index+1) & (stream.name_capacity-1);
+    }
+}
+
+// Moves the token's text out of the window before the next refill reuses it.
+static Token keep_token(Token token) {
+    if (token.type == TOKEN_ERROR || token.type == TOKEN_EOF) return token;
+
+    if (token.type == TOKEN_IDENTIFIER) {
+        token.start = intern_name(token.start, token.length, token.hash);
+        return token;
+    }
+
+    int slot = stream.ring_next;
+    stream.ring_next = (slot+1) % TOKEN_RING;
+
+    // Copies stay NUL-terminated so number literals can go straight to strtod.
+    if (stream.ring_capacity[slot] < token.length + 1) {
+        stream.ring_capacity[slot] = token.length + 1 < 64 ? 64 : token.length + 1;
+        stream.ring[slot] = realloc(stream.ring[slot], stream.ring_capacity[slot]);
+        if (stream.ring[slot] == NULL) exit(1);
+    }
+    memcpy(stream.ring[slot], token.start, token.length);
+    stream.ring[slot][token.length] = '\0';
+    token.start = stream.ring[slot];
+    return token;
+}
+
+Token scan_token() {
+    if (stream.read == NULL) return scan_source_token();
+
+    // Skipped whitespace is dropped from the window, so only the longest
+    // token or comment decides how large it grows.
+    for (;;) {
+        skip_wspace();
+        if (stream.eof || stream.limit - scanner.curr >= STREAM_LOOKAHEAD) break;
+        refill(scanner.start);
+    }
+
+    for (;;) {
+        const char* from = scanner.curr;
+        int line = scanner.line;
+        Token token = scan_source_token();
+
+        // Ending this close to the limit, the token may have been cut short
+        // or decided by the sentinel, so scan it again with more input.
+        if (stream.eof || stream.limit - scanner.curr >= STREAM_LOOKAHEAD) return keep_token(token);
+
+        scanner.line = line;
+        refill(from);
+    }
+}
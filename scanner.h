@@ -5,6 +5,8 @@
 #ifndef FAVE_CUH_SCANNER_H
 #define FAVE_CUH_SCANNER_H
 
+#include "common.h"
+
 typedef enum {
     // Single-character tokens.
     TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
@@ -32,9 +34,16 @@ typedef struct {
     const char* start;
     int length;
     int line;
+    uint32_t hash; // Hash of the lexeme for identifiers, so interning them needn't rehash.
 } Token;
 
+// Writes up to size bytes of source into buffer and returns how many it
+// wrote; 0 means the input is exhausted.
+typedef size_t (*ScannerReader)(void* context, char* buffer, size_t size);
+
 void init_scanner(const char* src);
+void init_scanner_stream(ScannerReader read, void* context);
+void free_scanner();
 Token scan_token();
 
 #endif //FAVE_CUH_SCANNER_H
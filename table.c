@@ -5,128 +5,276 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "table.h"
 #include "memory.h"
+#include "object.h"
 #include "value.h"
-#include "memory.h"
 
-#define TABLE_MAX_LOAD 0.75
+// Full slots may use at most 7/8 of the capacity, tombstones included.
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+#define TABLE_GROW_CAPACITY(capacity) \
+    ((capacity) < TABLE_GROUP_WIDTH ? TABLE_GROUP_WIDTH : (capacity) * 2)
+
+static inline uint32_t hash_group(uint32_t hash) {
+    return hash >> 7;
+}
+
+static inline int8_t hash_fragment(uint32_t hash) {
+    return (int8_t) (hash & 0x7f);
+}
+
+#ifdef __SSE2__
+
+static inline uint32_t group_match(const int8_t* control, int8_t fragment) {
+    __m128i group = _mm_loadu_si128((const __m128i*) control);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(fragment)));
+}
+
+static inline uint32_t group_match_empty_or_deleted(const int8_t* control) {
+    // Both special bytes have the sign bit set, full slots never do.
+    return (uint32_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) control));
+}
+
+#else
+
+static inline uint32_t group_match(const int8_t* control, int8_t fragment) {
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        if (control[i] == fragment) mask |= 1u << i;
+    }
+    return mask;
+}
+
+static inline uint32_t group_match_empty_or_deleted(const int8_t* control) {
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        if (control[i] < 0) mask |= 1u << i;
+    }
+    return mask;
+}
+
+#endif
+
+static inline int lowest_bit(uint32_t mask) {
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int bit = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
 
 void init_table(Table* table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
-    table->entries = NULL;
+    table->control = NULL;
+    table->keys = NULL;
+    table->values = NULL;
 }
 
 void free_table(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(int8_t, table->control, table->capacity);
+    FREE_ARRAY(ObjString*, table->keys, table->capacity);
+    FREE_ARRAY(Value, table->values, table->capacity);
     init_table(table);
 }
 
-static Entry* find_entry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t idx = key->hash % capacity;
-    Entry* tombstone = NULL;
+// Groups are visited in triangular order, which reaches every group
+// once the capacity is a power of two.
+static int find_slot(Table* table, ObjString* key) {
+    if (table->count == 0) return -1;
 
-    for (;;) {
-        Entry* entry = &entries[idx];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->val)) {
-                return tombstone != NULL ? tombstone : entry; // Empty entry
-            } else {
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            return entry;
+    uint32_t group_mask = (uint32_t) (table->capacity / TABLE_GROUP_WIDTH) - 1;
+    uint32_t group = hash_group(key->hash) & group_mask;
+    int8_t fragment = hash_fragment(key->hash);
+
+    for (uint32_t step = 1;; step++) {
+        int base = (int) group * TABLE_GROUP_WIDTH;
+        const int8_t* control = &table->control[base];
+
+        for (uint32_t match = group_match(control, fragment); match != 0; match &= match-1) {
+            int slot = base + lowest_bit(match);
+            if (table->keys[slot] == key) return slot;
         }
 
-        idx = (idx+1) % capacity;
+        if (group_match(control, CTRL_EMPTY) != 0) return -1;
+        group = (group + step) & group_mask;
     }
 }
 
-bool table_get(Table* table, ObjString* key, Value* val) {
-    if (table->count == 0) return false;
+static int find_insert_slot(int8_t* control, int capacity, uint32_t hash) {
+    uint32_t group_mask = (uint32_t) (capacity / TABLE_GROUP_WIDTH) - 1;
+    uint32_t group = hash_group(hash) & group_mask;
+
+    for (uint32_t step = 1;; step++) {
+        int base = (int) group * TABLE_GROUP_WIDTH;
+        uint32_t match = group_match_empty_or_deleted(&control[base]);
+        if (match != 0) return base + lowest_bit(match);
+
+        group = (group + step) & group_mask;
+    }
+}
+
+static void erase_slot(Table* table, int slot) {
+    // A group that still has an empty slot never sent a probe on to the
+    // next group, so the slot can become empty instead of a tombstone.
+    int base = slot & ~(TABLE_GROUP_WIDTH - 1);
+    if (group_match(&table->control[base], CTRL_EMPTY) != 0) {
+        table->control[slot] = CTRL_EMPTY;
+    } else {
+        table->control[slot] = CTRL_DELETED;
+        table->tombstones++;
+    }
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    table->keys[slot] = NULL;
+    table->values[slot] = NIL_VAL;
+    table->count--;
+}
+
+bool table_get(Table* table, ObjString* key, Value* val) {
+    int slot = find_slot(table, key);
+    if (slot == -1) return false;
 
-    *val = entry->val;
+    *val = table->values[slot];
     return true;
 }
 
 static void adjust_capacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
-
-    for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].val = NIL_VAL;
-    }
+    int8_t* control = ALLOCATE(int8_t, capacity);
+    ObjString** keys = ALLOCATE(ObjString*, capacity);
+    Value* values = ALLOCATE(Value, capacity);
+    memset(control, CTRL_EMPTY, capacity);
 
-    table->count = 0;
     for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;
+        if (!table_slot_full(table, i)) continue;
 
-        Entry* dest = find_entry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->val = entry->val;
-        table->count++;
+        ObjString* key = table->keys[i];
+        int slot = find_insert_slot(control, capacity, key->hash);
+        control[slot] = hash_fragment(key->hash);
+        keys[slot] = key;
+        values[slot] = table->values[i];
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(int8_t, table->control, table->capacity);
+    FREE_ARRAY(ObjString*, table->keys, table->capacity);
+    FREE_ARRAY(Value, table->values, table->capacity);
 
-    table->entries = entries;
+    table->control = control;
+    table->keys = keys;
+    table->values = values;
     table->capacity = capacity;
+    table->tombstones = 0;
 }
 
 bool table_set(Table* table, ObjString* key, Value val) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, capacity);
+    int slot = find_slot(table, key);
+    if (slot != -1) {
+        table->values[slot] = val;
+        return false;
+    }
+
+    if (table->count + table->tombstones + 1 > TABLE_MAX_LOAD(table->capacity)) {
+        // Mostly tombstones: rebuilding at the same size is enough.
+        bool rehash_in_place = table->tombstones > table->count;
+        adjust_capacity(table, rehash_in_place ? table->capacity : TABLE_GROW_CAPACITY(table->capacity));
     }
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    bool is_new_key = entry->key == NULL;
-    if (is_new_key && IS_NIL(entry->val)) table->count++;
+    slot = find_insert_slot(table->control, table->capacity, key->hash);
+    if (table->control[slot] == CTRL_DELETED) table->tombstones--;
 
-    entry->key = key;
-    entry->val = val;
-    return is_new_key;
+    table->control[slot] = hash_fragment(key->hash);
+    table->keys[slot] = key;
+    table->values[slot] = val;
+    table->count++;
+    return true;
 }
 
 bool table_delete(Table* table, ObjString* key) {
-    if (table->count == 0) return false;
+    int slot = find_slot(table, key);
+    if (slot == -1) return false;
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
-
-    entry->key = NULL;
-    entry->val = BOOL_VAL(true);
+    erase_slot(table, slot);
     return true;
 }
 
 void table_add_all(Table* from , Table* to) {
     for (int i = 0; i < from->capacity; i++) {
-        Entry* entry = &from->entries[i];
-        if (entry->key != NULL) table_set(to, entry->key, entry->val);
+        if (table_slot_full(from, i)) table_set(to, from->keys[i], from->values[i]);
     }
 }
 
 ObjString* table_find_string(Table* table, const char* chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    uint32_t idx = hash % table->capacity;
+    uint32_t group_mask = (uint32_t) (table->capacity / TABLE_GROUP_WIDTH) - 1;
+    uint32_t group = hash_group(hash) & group_mask;
+    int8_t fragment = hash_fragment(hash);
+
+    for (uint32_t step = 1;; step++) {
+        int base = (int) group * TABLE_GROUP_WIDTH;
+        const int8_t* control = &table->control[base];
 
-    for (;;) {
-        Entry* entry = &table->entries[idx];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->val)) return NULL; // Empty non-tombstone entry
-        } else if (entry->key->length == length &&
-                    entry->key->hash == hash &&
-                    memcmp(entry->key->chars, chars, length) == 0) {
-            return entry->key;
+        for (uint32_t match = group_match(control, fragment); match != 0; match &= match-1) {
+            ObjString* key = table->keys[base + lowest_bit(match)];
+            if (key->hash == hash &&
+                key->length == length &&
+                memcmp(key->chars, chars, length) == 0) {
+                return key;
+            }
         }
 
-        idx = (idx+1) % table->capacity;
+        if (group_match(control, CTRL_EMPTY) != 0) return NULL;
+        group = (group + step) & group_mask;
     }
+}
 
-}
\ No newline at end of file
+void table_remove_white(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        if (!table_slot_full(table, i)) continue;
+
+        ObjString* key = table->keys[i];
+        if (!key->obj.is_marked && !is_young((Obj*) key)) erase_slot(table, i);
+    }
+}
+
+void mark_table(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        if (!table_slot_full(table, i)) continue;
+
+        mark_object((Obj*) table->keys[i]);
+        mark_value(table->values[i]);
+    }
+}
+
+void table_remove_young(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        if (!table_slot_full(table, i) || !is_young((Obj*) table->keys[i])) continue;
+
+        // Promotion keeps the hash, so a surviving key stays in its slot.
+        ObjString* promoted = (ObjString*) forwarding_address((Obj*) table->keys[i]);
+        if (promoted != NULL) {
+            table->keys[i] = promoted;
+        } else {
+            erase_slot(table, i);
+        }
+    }
+}
+
+void promote_table(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        if (!table_slot_full(table, i)) continue;
+
+        promote_object((Obj**) &table->keys[i]);
+        promote_value(&table->values[i]);
+    }
+}
@@ -8,15 +8,22 @@
 #include "common.h"
 #include "value.h"
 
-typedef struct Entry {
-    ObjString* key;
-    Value val;
-} Entry;
+// Swiss-table layout: slots are probed in aligned groups of
+// TABLE_GROUP_WIDTH, using one control byte per slot. A control byte is
+// CTRL_EMPTY, CTRL_DELETED, or, for a full slot, the low 7 bits of the
+// key's hash. Keys and values live in parallel arrays.
+#define TABLE_GROUP_WIDTH 16
+
+#define CTRL_EMPTY   ((int8_t) -128)
+#define CTRL_DELETED ((int8_t) -2)
 
 typedef struct {
     int count;
-    int capacity;
-    Entry* entries;
+    int tombstones;
+    int capacity; // Always zero or a power of two, at least TABLE_GROUP_WIDTH.
+    int8_t* control;
+    ObjString** keys;
+    Value* values;
 } Table;
 
 void init_table(Table* table);
@@ -26,6 +33,13 @@ bool table_set(Table* table, ObjString* key, Value val);
 bool table_delete(Table* table, ObjString* key);
 void table_add_all(Table* from , Table* to);
 ObjString* table_find_string(Table* table, const char* chars, int length, uint32_t hash);
+void table_remove_white(Table* table);
+void mark_table(Table* table);
+void table_remove_young(Table* table);
+void promote_table(Table* table);
 
+static inline bool table_slot_full(Table* table, int slot) {
+    return table->control[slot] >= 0;
+}
 
 #endif //FAVE_CUH_TABLE_H
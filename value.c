@@ -32,6 +32,17 @@ void free_value_array(ValueArray* arr) {
 }
 
 void print_value(Value val) {
+#ifdef NAN_BOXING
+    if (IS_BOOL(val)) {
+        printf(AS_BOOL(val) ? "true" : "false");
+    } else if (IS_NIL(val)) {
+        printf("NIL");
+    } else if (IS_NUMBER(val)) {
+        printf("%g", AS_NUMBER(val));
+    } else if (IS_OBJ(val)) {
+        print_object(val);
+    }
+#else
     switch (val.type) {
         case VAL_BOOL:
             printf(AS_BOOL(val) ? "true" : "false");
@@ -39,16 +50,25 @@ void print_value(Value val) {
         case VAL_NIL: printf("NIL"); break;
         case VAL_NUMBER: printf("%g", AS_NUMBER(val)); break;
         case VAL_OBJ: print_object(val); break;
+        case VAL_UNDEFINED: break; // Only marks unassigned global slots.
     }
+#endif
 }
 
 bool values_equal(Value a, Value b) {
+#ifdef NAN_BOXING
+    // Compare numbers as doubles so NaN != NaN, like the tagged representation.
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
+    return a == b;
+#else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL:      return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:       return true;
+        case VAL_UNDEFINED: return true;
         case VAL_NUMBER:    return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ:       return AS_OBJ(a) == AS_OBJ(b);
         default:            return false; // unreachable.
     }
+#endif
 }
\ No newline at end of file
@@ -5,16 +5,66 @@
 #ifndef FAVE_CUH_VALUE_H
 #define FAVE_CUH_VALUE_H
 
+#include <string.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+// Every Value is a 64-bit double. Non-number values live in the payload of a
+// quiet NaN: singletons use the low tag bits, objects set the sign bit and
+// store the pointer in the low 48 bits.
+#define SIGN_BIT    ((uint64_t)0x8000000000000000)
+#define QNAN        ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL     1 // 01.
+#define TAG_FALSE   2 // 10.
+#define TAG_TRUE    3 // 11.
+#define TAG_UNDEFINED 4 // 100.
+
+typedef uint64_t Value;
+
+#define IS_BOOL(val)        (((val) | 1) == TRUE_VAL)
+#define IS_NIL(val)         ((val) == NIL_VAL)
+#define IS_UNDEFINED(val)   ((val) == UNDEFINED_VAL)
+#define IS_NUMBER(val)      (((val) & QNAN) != QNAN)
+#define IS_OBJ(val)         (((val) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(val)        ((val) == TRUE_VAL)
+#define AS_NUMBER(val)      value_to_num(val)
+#define AS_OBJ(val)         ((Obj*)(uintptr_t)((val) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(val)       ((val) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL           ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL            ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL             ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL       ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(val)     num_to_value(val)
+#define OBJ_VAL(object)     (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object))
+
+static inline double value_to_num(Value val) {
+    double num;
+    memcpy(&num, &val, sizeof(Value));
+    return num;
+}
+
+static inline Value num_to_value(double num) {
+    Value val;
+    memcpy(&val, &num, sizeof(double));
+    return val;
+}
+
+#else
+
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_UNDEFINED,
 } ValueType;
 
 typedef struct {
@@ -28,6 +78,7 @@ typedef struct {
 
 #define IS_BOOL(val)        ((val).type == VAL_BOOL)
 #define IS_NIL(val)         ((val).type == VAL_NIL)
+#define IS_UNDEFINED(val)   ((val).type == VAL_UNDEFINED)
 #define IS_NUMBER(val)      ((val).type == VAL_NUMBER)
 #define IS_OBJ(val)         ((val).type == VAL_OBJ)
 
@@ -37,9 +88,12 @@ typedef struct {
 
 #define BOOL_VAL(val)       ((Value){VAL_BOOL, {.boolean = val}})
 #define NIL_VAL             ((Value){VAL_NIL, {.number = 0}})
+#define UNDEFINED_VAL       ((Value){VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(val)     ((Value){VAL_NUMBER, {.number = val}})
 #define OBJ_VAL(object)     ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
+#endif
+
 typedef struct {
     int capacity;
     int count;
@@ -9,10 +9,16 @@
 #include "vm.h"
 #include "debug.h"
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 
 VM vm;
+_Thread_local Heap* thread_heap = NULL;
+
+// Concatenations at least this long build a rope instead of copying.
+#define ROPE_MIN_LENGTH 64
 
 void free_objects();
 
@@ -38,17 +44,66 @@ static void runtime_error(const char* format, ...) {
 void init_VM() {
     reset_stack();
     vm.objects = NULL;
+    vm.bytes_allocated = 0;
+    vm.next_GC = 1024 * 1024;
+
+    vm.gray_count = 0;
+    vm.gray_capacity = 0;
+    vm.gray_stack = NULL;
 
-    init_table(&vm.globals);
+    init_nursery();
+
+    init_table(&vm.global_names);
+    init_value_array(&vm.global_values);
     init_table(&vm.strings);
+    vm.linking = NULL;
 }
 
 void free_VM() {
-    free_table(&vm.globals);
+    free_table(&vm.global_names);
+    free_value_array(&vm.global_values);
     free_table(&vm.strings);
     free_objects();
 }
 
+// Globals live in vm.global_values. vm.global_names maps each name to its
+// slot; the compiler resolves the slot once so the VM only indexes the array.
+int define_global_slot(ObjString* name) {
+    Value slot;
+    if (thread_heap != NULL) {
+        if (table_get(&thread_heap->global_names, name, &slot)) return (int) AS_NUMBER(slot);
+        table_set(&thread_heap->global_names, name, NUMBER_VAL(thread_heap->global_count));
+        return thread_heap->global_count++;
+    }
+
+    if (table_get(&vm.global_names, name, &slot)) return (int) AS_NUMBER(slot);
+
+    push(OBJ_VAL(name));
+    write_value_array(&vm.global_values, UNDEFINED_VAL);
+    table_set(&vm.global_names, name, NUMBER_VAL(vm.global_values.count-1));
+    pop();
+
+    return vm.global_values.count-1;
+}
+
+// Forgets every global slot from count on, for a load that turned out not to fit.
+void truncate_globals(int count) {
+    for (int i = 0; i < vm.global_names.capacity; i++) {
+        if (table_slot_full(&vm.global_names, i) && (int) AS_NUMBER(vm.global_names.values[i]) >= count) {
+            table_delete(&vm.global_names, vm.global_names.keys[i]);
+        }
+    }
+    vm.global_values.count = count;
+}
+
+ObjString* global_slot_name(int slot) {
+    Table* names = thread_heap != NULL ? &thread_heap->global_names : &vm.global_names;
+    for (int i = 0; i < names->capacity; i++) {
+        if (table_slot_full(names, i) && (int) AS_NUMBER(names->values[i]) == slot) return names->keys[i];
+    }
+    return NULL; // unreachable: every slot is created with a name.
+}
+
 void push(Value val) {
     *vm.stack_top = val;
     vm.stack_top++;
@@ -63,31 +118,68 @@ static Value peek(int distance) {
     return vm.stack_top[-1 - distance];
 }
 
-static bool is_falsey(Value val) {
+bool is_falsey(Value val) {
     return IS_NIL(val) || (IS_BOOL(val) && !AS_BOOL(val));
 }
 
+static void flatten_operand(int distance) {
+    Value* slot = &vm.stack_top[-1 - distance];
+    if (IS_ROPE(*slot)) *slot = OBJ_VAL(flatten_rope(AS_ROPE(*slot)));
+}
+
 static void concatenate() {
-    ObjString* b = AS_STRING(pop());
-    ObjString* a = AS_STRING(pop());
+    int length = text_length(peek(0)) + text_length(peek(1));
+
+    // Any rope operand is itself at least ROPE_MIN_LENGTH long, so the flat
+    // path below only ever sees two strings.
+    if (length >= ROPE_MIN_LENGTH) {
+        ObjRope* rope = new_rope(length);
+        rope->left = AS_OBJ(peek(1));
+        rope->right = AS_OBJ(peek(0));
+        write_barrier((Obj*) rope, peek(1));
+        write_barrier((Obj*) rope, peek(0));
+
+        pop();
+        pop();
+        push(OBJ_VAL(rope));
+        return;
+    }
+
+    ObjString* result = make_string(length);
 
-    int length = a->length+b->length;
-    char* chars = ALLOCATE(char, length+1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    // Read the operands only after allocating: a minor collection may have moved them.
+    ObjString* b = AS_STRING(peek(0));
+    ObjString* a = AS_STRING(peek(1));
+    memcpy(result->chars, a->chars, a->length);
+    memcpy(result->chars + a->length, b->chars, b->length);
 
-    ObjString* result = take_string(chars, length);
+    result = intern_string(result);
+    pop();
+    pop();
     push(OBJ_VAL(result));
 }
 
+static bool add() {
+    if (is_text(peek(0)) && is_text(peek(1))) {
+        concatenate();
+    } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+
+        push(NUMBER_VAL(a + b));
+    } else {
+        runtime_error("Operands must be two numbers or two strings.");
+        return false;
+    }
+    return true;
+}
+
 static InterpretResult run() {
     CallFrame* frame = &vm.frames[vm.frame_count-1];
 
 #define READ_BYTE() (*frame->ip++)
 #define READ_CONSTANT() \
     (frame->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
 #define READ_SHORT() \
     (frame->ip += 2, \
     (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
@@ -101,151 +193,424 @@ static InterpretResult run() {
         double a = AS_NUMBER(pop()); \
         push(value_type(a op b)); \
     } while (false)
+#define NEGATED_BINARY_OP(op) \
+    do {              \
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+            runtime_error("Operands must be numbers"); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        double b = AS_NUMBER(pop()); \
+        double a = AS_NUMBER(pop()); \
+        push(BOOL_VAL(!(a op b))); \
+    } while (false)
+// Three-address ops: the first operand names the destination slot, the
+// second a source slot, and the third a source slot or constant.
+#define REGISTER_OP(op, read_b) \
+    do { \
+        Value* dest = &frame->slots[READ_BYTE()]; \
+        Value a = frame->slots[READ_BYTE()]; \
+        Value b = read_b; \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+            runtime_error("Operands must be numbers"); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        *dest = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+#define REGISTER_ADD(read_b) \
+    do { \
+        Value* dest = &frame->slots[READ_BYTE()]; \
+        Value a = frame->slots[READ_BYTE()]; \
+        Value b = read_b; \
+        if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+            *dest = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)); \
+        } else { \
+            push(a); \
+            push(b); \
+            if (!add()) return INTERPRET_RUNTIME_ERROR; \
+            *dest = pop(); \
+        } \
+    } while (false)
+// Rewrites the current instruction in place. Quickened forms that see
+// operands they weren't specialized for put back the generic opcode and
+// re-dispatch it, and the generic handler specializes again. Code borrowed
+// from a bytecode image is mapped read-only and shared, so it stays generic.
+#define QUICKEN(op) \
+    do { \
+        if (!frame->function->chunk.borrowed) frame->ip[-1] = (op); \
+    } while (false)
+#define DEQUICKEN(op) \
+    do { \
+        *--frame->ip = (op); \
+        DISPATCH(); \
+    } while (false)
+#define LOCAL_CONSTANT_JUMP(op, jump_if) \
+    do { \
+        Value a = frame->slots[READ_BYTE()]; \
+        Value b = READ_CONSTANT(); \
+        uint16_t offset = READ_SHORT(); \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+            runtime_error("Operands must be numbers"); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        if ((AS_NUMBER(a) op AS_NUMBER(b)) == jump_if) frame->ip += offset; \
+    } while (false)
 
-    for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
-            printf("[ ");
-            print_value(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassemble_instruction(&frame->function->chunk,
-                               (int)(frame->ip - frame->function->chunk.code));
+#define TRACE_INSTRUCTION() \
+    do { \
+        printf("          "); \
+        for (Value* slot = vm.stack; slot < vm.stack_top; slot++) { \
+            printf("[ "); \
+            print_value(*slot); \
+            printf(" ]"); \
+        } \
+        printf("\n"); \
+        disassemble_instruction(&frame->function->chunk, \
+                               (int)(frame->ip - frame->function->chunk.code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
 
+    uint8_t instruction;
+
+#ifdef COMPUTED_GOTO
+    // Every handler ends in its own indirect jump so the branch predictor
+    // gets one history slot per opcode instead of one for the whole loop.
+    static void* dispatch_table[] = {
+        [OP_CONSTANT]                  = &&target_OP_CONSTANT,
+        [OP_NIL]                       = &&target_OP_NIL,
+        [OP_TRUE]                      = &&target_OP_TRUE,
+        [OP_FALSE]                     = &&target_OP_FALSE,
+        [OP_POP]                       = &&target_OP_POP,
+        [OP_GET_LOCAL]                 = &&target_OP_GET_LOCAL,
+        [OP_GET_GLOBAL]                = &&target_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL]             = &&target_OP_DEFINE_GLOBAL,
+        [OP_SET_LOCAL]                 = &&target_OP_SET_LOCAL,
+        [OP_SET_LOCAL_POP]             = &&target_OP_SET_LOCAL_POP,
+        [OP_SET_GLOBAL]                = &&target_OP_SET_GLOBAL,
+        [OP_EQUAL]                     = &&target_OP_EQUAL,
+        [OP_GREATER]                   = &&target_OP_GREATER,
+        [OP_LESS]                      = &&target_OP_LESS,
+        [OP_NOT_EQUAL]                 = &&target_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL]             = &&target_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL]                = &&target_OP_LESS_EQUAL,
+        [OP_ADD]                       = &&target_OP_ADD,
+        [OP_SUBTRACT]                  = &&target_OP_SUBTRACT,
+        [OP_MULTIPLY]                  = &&target_OP_MULTIPLY,
+        [OP_DIVIDE]                    = &&target_OP_DIVIDE,
+        [OP_NOT]                       = &&target_OP_NOT,
+        [OP_NEGATE]                    = &&target_OP_NEGATE,
+        [OP_PRINT]                     = &&target_OP_PRINT,
+        [OP_JUMP]                      = &&target_OP_JUMP,
+        [OP_JUMP_IF_FALSE]             = &&target_OP_JUMP_IF_FALSE,
+        [OP_LOOP]                      = &&target_OP_LOOP,
+        [OP_ADD_LOCAL_LOCAL]           = &&target_OP_ADD_LOCAL_LOCAL,
+        [OP_INCREMENT_LOCAL]           = &&target_OP_INCREMENT_LOCAL,
+        [OP_INCREMENT_LOCAL_POP]       = &&target_OP_INCREMENT_LOCAL_POP,
+        [OP_DECREMENT_LOCAL]           = &&target_OP_DECREMENT_LOCAL,
+        [OP_DECREMENT_LOCAL_POP]       = &&target_OP_DECREMENT_LOCAL_POP,
+        [OP_JUMP_UNLESS_LESS_LOCAL]    = &&target_OP_JUMP_UNLESS_LESS_LOCAL,
+        [OP_JUMP_UNLESS_GREATER_LOCAL] = &&target_OP_JUMP_UNLESS_GREATER_LOCAL,
+        [OP_JUMP_IF_LESS_LOCAL]        = &&target_OP_JUMP_IF_LESS_LOCAL,
+        [OP_JUMP_IF_GREATER_LOCAL]     = &&target_OP_JUMP_IF_GREATER_LOCAL,
+        [OP_ADD_REG_REG]               = &&target_OP_ADD_REG_REG,
+        [OP_ADD_REG_CONST]             = &&target_OP_ADD_REG_CONST,
+        [OP_SUBTRACT_REG_REG]          = &&target_OP_SUBTRACT_REG_REG,
+        [OP_SUBTRACT_REG_CONST]        = &&target_OP_SUBTRACT_REG_CONST,
+        [OP_MULTIPLY_REG_REG]          = &&target_OP_MULTIPLY_REG_REG,
+        [OP_MULTIPLY_REG_CONST]        = &&target_OP_MULTIPLY_REG_CONST,
+        [OP_DIVIDE_REG_REG]            = &&target_OP_DIVIDE_REG_REG,
+        [OP_DIVIDE_REG_CONST]          = &&target_OP_DIVIDE_REG_CONST,
+        [OP_ADD_NUM]                   = &&target_OP_ADD_NUM,
+        [OP_ADD_STR]                   = &&target_OP_ADD_STR,
+        [OP_EQUAL_NUM]                 = &&target_OP_EQUAL_NUM,
+        [OP_NOT_EQUAL_NUM]             = &&target_OP_NOT_EQUAL_NUM,
+        [OP_RETURN]                    = &&target_OP_RETURN,
+    };
+
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        goto *dispatch_table[instruction = READ_BYTE()]; \
+    } while (false)
+#define INTERPRET_LOOP DISPATCH();
+#define TARGET(op) target_##op
+#else
+#define DISPATCH() goto loop
+#define INTERPRET_LOOP \
+    loop: \
+        TRACE_INSTRUCTION(); \
+        switch (instruction = READ_BYTE())
+#define TARGET(op) case op
 #endif
 
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtime_error("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_SUBTRACT: {
-                BINARY_OP(NUMBER_VAL, -);
-                break;
+    INTERPRET_LOOP
+    {
+        TARGET(OP_ADD): {
+            if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                QUICKEN(OP_ADD_NUM);
+            } else if (is_text(peek(0)) && is_text(peek(1))) {
+                QUICKEN(OP_ADD_STR);
             }
-            case OP_MULTIPLY: {
-                BINARY_OP(NUMBER_VAL, *);
-                break;
-            }
-            case OP_DIVIDE: {
-                BINARY_OP(NUMBER_VAL, /);
-                break;
-            }
-            case OP_NOT: {
-                push(BOOL_VAL(is_falsey(pop())));
-                break;
-            }
-            case OP_NEGATE: {
-                if (!IS_NUMBER(peek(0))) {
-                    runtime_error("Operand must be a number");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            }
-            case OP_PRINT:
-                print_value(pop());
-                printf("\n");
-                break;
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
-            }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (is_falsey(peek(0))) frame->ip += offset;
-                break;
-            }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+
+            if (!add()) return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
+        TARGET(OP_ADD_NUM): {
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) DEQUICKEN(OP_ADD);
+
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            push(NUMBER_VAL(a + b));
+            DISPATCH();
+        }
+        TARGET(OP_ADD_STR): {
+            if (!is_text(peek(0)) || !is_text(peek(1))) DEQUICKEN(OP_ADD);
+
+            concatenate();
+            DISPATCH();
+        }
+        TARGET(OP_SUBTRACT): {
+            BINARY_OP(NUMBER_VAL, -);
+            DISPATCH();
+        }
+        TARGET(OP_MULTIPLY): {
+            BINARY_OP(NUMBER_VAL, *);
+            DISPATCH();
+        }
+        TARGET(OP_DIVIDE): {
+            BINARY_OP(NUMBER_VAL, /);
+            DISPATCH();
+        }
+        TARGET(OP_NOT): {
+            push(BOOL_VAL(is_falsey(pop())));
+            DISPATCH();
+        }
+        TARGET(OP_NEGATE): {
+            if (!IS_NUMBER(peek(0))) {
+                runtime_error("Operand must be a number");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_RETURN: {
-                // Exit interpreter.
-                return INTERPRET_OK;
+
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            DISPATCH();
+        }
+        TARGET(OP_PRINT): {
+            print_value(pop());
+            printf("\n");
+            DISPATCH();
+        }
+        TARGET(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            frame->ip += offset;
+            DISPATCH();
+        }
+        TARGET(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (is_falsey(peek(0))) frame->ip += offset;
+            DISPATCH();
+        }
+        TARGET(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            frame->ip -= offset;
+#ifdef JIT
+            ObjFunction* function = frame->function;
+            if (function->hotness < JIT_THRESHOLD && ++function->hotness == JIT_THRESHOLD) {
+                jit_compile(function);
             }
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
+            // Runs until an instruction needs the interpreter, leaving frame->ip on it.
+            if (function->jit != NULL) jit_enter(frame);
+#endif
+            DISPATCH();
+        }
+        TARGET(OP_ADD_LOCAL_LOCAL): {
+            Value a = frame->slots[READ_BYTE()];
+            Value b = frame->slots[READ_BYTE()];
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+            } else {
+                push(a);
+                push(b);
+                if (!add()) return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop(); break;
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
+            DISPATCH();
+        }
+        TARGET(OP_INCREMENT_LOCAL):
+        TARGET(OP_INCREMENT_LOCAL_POP): {
+            uint8_t slot = READ_BYTE();
+            Value k = READ_CONSTANT();
+            Value val = frame->slots[slot];
+            if (IS_NUMBER(val) && IS_NUMBER(k)) {
+                val = NUMBER_VAL(AS_NUMBER(val) + AS_NUMBER(k));
+            } else {
+                push(val);
+                push(k);
+                if (!add()) return INTERPRET_RUNTIME_ERROR;
+                val = pop();
             }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
+
+            frame->slots[slot] = val;
+            if (instruction == OP_INCREMENT_LOCAL) push(val);
+            DISPATCH();
+        }
+        // Kept apart from the increments so a type error reads like OP_SUBTRACT's.
+        TARGET(OP_DECREMENT_LOCAL):
+        TARGET(OP_DECREMENT_LOCAL_POP): {
+            uint8_t slot = READ_BYTE();
+            Value k = READ_CONSTANT();
+            Value val = frame->slots[slot];
+            if (!IS_NUMBER(val) || !IS_NUMBER(k)) {
+                runtime_error("Operands must be numbers");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value val;
-                if (!table_get(&vm.globals, name, &val)) {
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(val);
-                break;
+
+            val = NUMBER_VAL(AS_NUMBER(val) - AS_NUMBER(k));
+            frame->slots[slot] = val;
+            if (instruction == OP_DECREMENT_LOCAL) push(val);
+            DISPATCH();
+        }
+        // The fused comparisons leave nothing on the stack, so the compiler omits the pops around them.
+        TARGET(OP_JUMP_UNLESS_LESS_LOCAL):      LOCAL_CONSTANT_JUMP(<, false); DISPATCH();
+        TARGET(OP_JUMP_UNLESS_GREATER_LOCAL):   LOCAL_CONSTANT_JUMP(>, false); DISPATCH();
+        TARGET(OP_JUMP_IF_LESS_LOCAL):          LOCAL_CONSTANT_JUMP(<, true); DISPATCH();
+        TARGET(OP_JUMP_IF_GREATER_LOCAL):       LOCAL_CONSTANT_JUMP(>, true); DISPATCH();
+        TARGET(OP_ADD_REG_REG):         REGISTER_ADD(frame->slots[READ_BYTE()]); DISPATCH();
+        TARGET(OP_ADD_REG_CONST):       REGISTER_ADD(READ_CONSTANT()); DISPATCH();
+        TARGET(OP_SUBTRACT_REG_REG):    REGISTER_OP(-, frame->slots[READ_BYTE()]); DISPATCH();
+        TARGET(OP_SUBTRACT_REG_CONST):  REGISTER_OP(-, READ_CONSTANT()); DISPATCH();
+        TARGET(OP_MULTIPLY_REG_REG):    REGISTER_OP(*, frame->slots[READ_BYTE()]); DISPATCH();
+        TARGET(OP_MULTIPLY_REG_CONST):  REGISTER_OP(*, READ_CONSTANT()); DISPATCH();
+        TARGET(OP_DIVIDE_REG_REG):      REGISTER_OP(/, frame->slots[READ_BYTE()]); DISPATCH();
+        TARGET(OP_DIVIDE_REG_CONST):    REGISTER_OP(/, READ_CONSTANT()); DISPATCH();
+        TARGET(OP_RETURN): {
+            // Exit interpreter, dropping the script so the next one starts clean.
+            vm.frame_count--;
+            vm.stack_top = frame->slots;
+            return INTERPRET_OK;
+        }
+        TARGET(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            push(constant);
+            DISPATCH();
+        }
+        TARGET(OP_NIL): push(NIL_VAL); DISPATCH();
+        TARGET(OP_TRUE): push(BOOL_VAL(true)); DISPATCH();
+        TARGET(OP_FALSE): push(BOOL_VAL(false)); DISPATCH();
+        TARGET(OP_POP): pop(); DISPATCH();
+        TARGET(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            push(frame->slots[slot]);
+            DISPATCH();
+        }
+        TARGET(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = peek(0);
+            DISPATCH();
+        }
+        TARGET(OP_SET_LOCAL_POP): {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = pop();
+            DISPATCH();
+        }
+        TARGET(OP_GET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value val = vm.global_values.values[slot];
+            if (IS_UNDEFINED(val)) {
+                runtime_error("Undefined variable '%s'.", global_slot_name(slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                table_set(&vm.globals, name, peek(0));
-                pop();
-                break;
+            push(val);
+            DISPATCH();
+        }
+        TARGET(OP_DEFINE_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            vm.global_values.values[slot] = peek(0);
+            pop();
+            DISPATCH();
+        }
+        TARGET(OP_SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.global_values.values[slot])) {
+                runtime_error("Undefined variable '%s'.", global_slot_name(slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                if (table_set(&vm.globals, name, peek(0))) {
-                    table_delete(&vm.globals, name);
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            vm.global_values.values[slot] = peek(0);
+            DISPATCH();
+        }
+        TARGET(OP_EQUAL): {
+            if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) QUICKEN(OP_EQUAL_NUM);
+            if (is_text(peek(0)) && is_text(peek(1))) {
+                flatten_operand(0);
+                flatten_operand(1);
             }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(values_equal(a, b)));
-                break;
+
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(values_equal(a, b)));
+            DISPATCH();
+        }
+        TARGET(OP_GREATER):  BINARY_OP(BOOL_VAL, >); DISPATCH();
+        TARGET(OP_LESS):     BINARY_OP(BOOL_VAL, <); DISPATCH();
+        TARGET(OP_NOT_EQUAL): {
+            if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) QUICKEN(OP_NOT_EQUAL_NUM);
+            if (is_text(peek(0)) && is_text(peek(1))) {
+                flatten_operand(0);
+                flatten_operand(1);
             }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
+
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(!values_equal(a, b)));
+            DISPATCH();
+        }
+        TARGET(OP_EQUAL_NUM): {
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) DEQUICKEN(OP_EQUAL);
+
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            push(BOOL_VAL(a == b));
+            DISPATCH();
+        }
+        TARGET(OP_NOT_EQUAL_NUM): {
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) DEQUICKEN(OP_NOT_EQUAL);
+
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            push(BOOL_VAL(a != b));
+            DISPATCH();
         }
+        // Negated rather than >= and <= so NaN compares the same as the unfused OP_NOT pair.
+        TARGET(OP_GREATER_EQUAL):   NEGATED_BINARY_OP(<); DISPATCH();
+        TARGET(OP_LESS_EQUAL):      NEGATED_BINARY_OP(>); DISPATCH();
     }
 
+    return INTERPRET_RUNTIME_ERROR; // unreachable
+
 #undef READ_BYTE
 #undef READ_CONSTANT
-#undef READ_STRING
 #undef READ_SHORT
 #undef BINARY_OP
+#undef NEGATED_BINARY_OP
+#undef REGISTER_OP
+#undef REGISTER_ADD
+#undef QUICKEN
+#undef DEQUICKEN
+#undef LOCAL_CONSTANT_JUMP
+#undef TRACE_INSTRUCTION
+#undef DISPATCH
+#undef INTERPRET_LOOP
+#undef TARGET
 }
 
 InterpretResult interpret(const char* src) {
     ObjFunction* func = compile(src);
     if (func == NULL) return INTERPRET_COMPILE_ERROR;
 
+    return interpret_function(func);
+}
+
+InterpretResult interpret_function(ObjFunction* func) {
     push(OBJ_VAL(func));
     CallFrame* frame = &vm.frames[vm.frame_count++];
     frame->function = func;
@@ -254,3 +619,73 @@ InterpretResult interpret(const char* src) {
 
     return run();
 }
+
+void init_heap(Heap* heap) {
+    heap->objects = NULL;
+    heap->bytes_allocated = 0;
+    init_table(&heap->strings);
+    init_table(&heap->global_names);
+    heap->global_count = 0;
+}
+
+static void link_function(ObjFunction* function, int* slots) {
+    if (function->name != NULL) {
+        function->name = intern_string(function->name);
+        write_barrier((Obj*) function, OBJ_VAL(function->name));
+    }
+
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (!IS_STRING(constants->values[i])) continue;
+        constants->values[i] = OBJ_VAL(intern_string(AS_STRING(constants->values[i])));
+        write_barrier((Obj*) function, constants->values[i]);
+    }
+
+    uint8_t* code = function->chunk.code;
+    for (int offset = 0; offset < function->chunk.count; offset += instruction_length(code[offset])) {
+        if (code[offset] != OP_GET_GLOBAL && code[offset] != OP_DEFINE_GLOBAL &&
+            code[offset] != OP_SET_GLOBAL) continue;
+
+        int slot = slots[(code[offset+1] << 8) | code[offset+2]];
+        code[offset+1] = (slot >> 8) & 0xff;
+        code[offset+2] = slot & 0xff;
+    }
+}
+
+// Merges a heap compiled on another thread into the VM. Its strings are
+// interned again, so a name compiled on two threads ends up one object,
+// and its global slots are renumbered into the VM's. Runs on the VM's
+// thread once the compile that filled the heap has finished.
+ObjFunction* link_heap(Heap* heap, ObjFunction* script) {
+    vm.bytes_allocated += heap->bytes_allocated;
+    vm.linking = heap;
+
+    int* slots = ALLOCATE(int, heap->global_count);
+    Table* names = &heap->global_names;
+    for (int i = 0; i < names->capacity; i++) {
+        if (!table_slot_full(names, i)) continue;
+        slots[(int) AS_NUMBER(names->values[i])] = define_global_slot(intern_string(names->keys[i]));
+    }
+
+    for (Obj* object = heap->objects; object != NULL; object = object->next) {
+        if (object->type == OBJ_FUNCTION) link_function((ObjFunction*) object, slots);
+    }
+
+    FREE_ARRAY(int, slots, heap->global_count);
+    free_table(&heap->strings);
+    free_table(&heap->global_names);
+    vm.linking = NULL;
+
+    // Collections during the link marked these without sweeping them.
+    Obj* last = NULL;
+    for (Obj* object = heap->objects; object != NULL; object = object->next) {
+        object->is_marked = false;
+        last = object;
+    }
+    if (last != NULL) {
+        last->next = vm.objects;
+        vm.objects = heap->objects;
+    }
+    heap->objects = NULL;
+    return script;
+}
@@ -19,14 +19,42 @@ typedef struct {
     Value* slots;
 } CallFrame;
 
+// Where a compile running off the VM's thread allocates. Nothing in it is
+// young or ever collected, and its strings and global slots are private
+// until link_heap() merges it into the VM on the VM's thread.
+typedef struct {
+    Obj* objects;
+    size_t bytes_allocated;
+    Table strings;
+    Table global_names;
+    int global_count;
+} Heap;
+
 typedef struct {
     CallFrame frames[FRAMES_MAX];
     int frame_count;
     Value stack[STACK_MAX];
     Value* stack_top;
     Table strings;
-    Table globals;
+    Table global_names;
+    ValueArray global_values;
     Obj* objects;
+
+    size_t bytes_allocated;
+    size_t next_GC;
+    int gray_count;
+    int gray_capacity;
+    Obj** gray_stack;
+
+    uint8_t* nursery;
+    uint8_t* nursery_top;
+    uint8_t* nursery_end;
+    bool collecting_nursery;
+    int remembered_count;
+    int remembered_capacity;
+    Obj** remembered;
+
+    Heap* linking; // Not in objects yet, so its objects are roots.
 } VM;
 
 typedef enum {
@@ -36,12 +64,20 @@ typedef enum {
 } InterpretResult;
 
 extern VM vm;
+extern _Thread_local Heap* thread_heap; // NULL on the VM's own thread.
 
 void init_VM();
 void free_VM();
 
 InterpretResult interpret(const char* src);
+InterpretResult interpret_function(ObjFunction* func);
+void init_heap(Heap* heap);
+ObjFunction* link_heap(Heap* heap, ObjFunction* script);
+int define_global_slot(ObjString* name);
+ObjString* global_slot_name(int slot);
+void truncate_globals(int count);
 void push(Value val);
 Value pop();
+bool is_falsey(Value val);
 
 #endif //FAVE_CUH_VM_H